@@ -0,0 +1,175 @@
+/*
+Times the string kernels against the scalar loops they fall back
+to, for inputs from a token to a whole file. string.c is compiled
+into this file rather than linked, to reach its kernels, which are
+static. Run it with `make bench`.
+*/
+#include "../src/string.c"
+
+#include <io.h>
+#include <utils.h>
+
+// every measurement goes over this many bytes, in calls of one size
+#define BENCH_BYTES_PER_RUN (1024 * 1024)
+#define BENCH_BUFFER_SIZE (64 * 1024)
+
+// the fastest of this many runs is reported
+#define BENCH_RUNS 32
+
+static u8 g_source[BENCH_BUFFER_SIZE + 1];
+static u8 g_dest[BENCH_BUFFER_SIZE];
+
+// what the routines did byte by byte before they had kernels
+static size_t strlen_scalar(char* cstr) {
+    size_t len = 0;
+    while (cstr[len] != '\0') {
+        len++;
+    }
+    return len;
+}
+
+static bool streq_scalar(char* a, char* b) {
+    while (*a != '\0' && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static StringKernels g_scalar_kernels = {
+    .name = "scalar",
+    .strlen = strlen_scalar,
+    .memcpy = memcpy_scalar,
+    .memset = memset_scalar,
+    .memchr = memchr_scalar,
+    .memchr_any = memchr_any_scalar,
+};
+
+typedef enum BenchOp {
+    BENCH_STRLEN,
+    BENCH_STREQ,
+    BENCH_MEMCPY,
+    BENCH_MEMSET,
+    BENCH_MEMCHR,
+    BENCH_MEMCHR_ANY,
+    BENCH_OP_COUNT,
+} BenchOp;
+
+static char* g_op_names[BENCH_OP_COUNT] = {
+    [BENCH_STRLEN] = "strlen",
+    [BENCH_STREQ] = "streq",
+    [BENCH_MEMCPY] = "memcpy",
+    [BENCH_MEMSET] = "memset",
+    [BENCH_MEMCHR] = "memchr",
+    [BENCH_MEMCHR_ANY] = "memchr_any",
+};
+
+// keeps the results alive, so that no call is optimized away
+static volatile u64 g_sink;
+
+/*
+Calls op on size bytes until BENCH_BYTES_PER_RUN have gone by, and
+returns the cycles it took. Every input runs to its end: strings are
+terminated at size, and the searched bytes never occur.
+*/
+static u64 bench_run(StringKernels* kernels, BenchOp op, size_t size) {
+    char* source = (char*)g_source;
+    char* dest = (char*)g_dest;
+    size_t calls = BENCH_BYTES_PER_RUN / size;
+    u64 sink = 0;
+
+    u64 start = __builtin_ia32_rdtsc();
+
+    for (size_t i = 0; i < calls; ++i) {
+        switch (op) {
+            case BENCH_STRLEN:
+                sink += kernels->strlen(source);
+                break;
+
+            case BENCH_STREQ:
+                // streq has a single kernel, the scalar set stands for the loop it replaced
+                sink += kernels == &g_scalar_kernels ? streq_scalar(source, dest) : streq(source, dest);
+                break;
+
+            case BENCH_MEMCPY:
+                kernels->memcpy(dest, source, size);
+                break;
+
+            case BENCH_MEMSET:
+                sink += (u64)kernels->memset(dest, 'x', size);
+                break;
+
+            case BENCH_MEMCHR:
+                sink += (u64)kernels->memchr(source, '\n', size);
+                break;
+
+            case BENCH_MEMCHR_ANY:
+                sink += (u64)kernels->memchr_any(source, "\n\\/?", size);
+                break;
+
+            case BENCH_OP_COUNT:
+                break;
+        }
+    }
+
+    u64 cycles = __builtin_ia32_rdtsc() - start;
+    g_sink = sink;
+    return cycles;
+}
+
+static void bench_prepare(BenchOp op, size_t size) {
+    memset_scalar(g_source, 'x', BENCH_BUFFER_SIZE);
+    g_source[size] = '\0';
+
+    // streq compares two equal strings all the way to the terminator
+    memcpy_scalar(g_dest, g_source, size + (op == BENCH_STREQ ? 1 : 0));
+}
+
+s32 main(void) {
+    string_init();
+
+    StringKernels* kernel_sets[4] = {&g_scalar_kernels, &g_sse2_kernels};
+    size_t kernel_set_count = 2;
+
+    if (g_cpu_features & CPU_FEATURE_AVX2) {
+        kernel_sets[kernel_set_count++] = &g_avx2_kernels;
+    }
+
+    if (g_cpu_features & CPU_FEATURE_AVX512BW) {
+        kernel_sets[kernel_set_count++] = &g_avx512_kernels;
+    }
+
+    // a short identifier, a long line, a page and a source file
+    size_t sizes[] = {8, 128, 4096, BENCH_BUFFER_SIZE - 1};
+
+    printf("cycles per KiB, fastest of %zu runs\n", (size_t)BENCH_RUNS);
+
+    for (BenchOp op = 0; op < BENCH_OP_COUNT; ++op) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+            size_t size = sizes[s];
+            bench_prepare(op, size);
+
+            printf("%s %zu:", g_op_names[op], size);
+
+            for (size_t k = 0; k < kernel_set_count; ++k) {
+                // streq has no wider kernels to compare
+                if (op == BENCH_STREQ && k > 1) {
+                    break;
+                }
+
+                u64 best = ~0ULL;
+                for (size_t run = 0; run < BENCH_RUNS; ++run) {
+                    best = UTILS_MIN(best, bench_run(kernel_sets[k], op, size));
+                }
+
+                size_t bytes = BENCH_BYTES_PER_RUN / size * size;
+                printf(" %s %zu", kernel_sets[k]->name, (size_t)(best * 1024 / bytes));
+            }
+
+            printf("\n");
+        }
+    }
+
+    io_flush_all();
+    return 0;
+}
@@ -3,11 +3,93 @@
 
 #include "types.h"
 
+typedef struct Arena {
+    size_t reserved;
+    size_t capacity;
+    size_t position;
+    u8* heap;
+
+    // what the allocations would take if each were rounded up to 16 bytes, for --stats
+    size_t unpacked_size;
+} Arena;
+
+// a point to return an arena to, dropping everything allocated since
+typedef struct ArenaMark {
+    size_t position;
+} ArenaMark;
+
+// where everything lives that is kept until exit
+extern Arena g_arena;
+
 void arena_init(void);
 void* arena_alloc(size_t size);
+void* arena_alloc_aligned(size_t size, size_t alignment);
+bool arena_try_extend(void* pointer, size_t old_size, size_t new_size);
 size_t arena_usage_KiB(void);
 
+// a zero initialized Arena reserves its memory on first use
+void* arena_alloc_in(Arena* arena, size_t size);
+void* arena_alloc_aligned_in(Arena* arena, size_t size, size_t alignment);
+bool arena_try_extend_in(Arena* arena, void* pointer, size_t old_size, size_t new_size);
+ArenaMark arena_mark(Arena* arena);
+void arena_rewind(Arena* arena, ArenaMark mark);
+
+/*
+An optional cap, in bytes, on the memory all arenas have committed
+plus whatever is charged to them from outside, such as mapped files.
+Going over it is fatal.
+*/
+void arena_set_budget(size_t bytes);
+void arena_charge(s64 bytes);
+bool arena_budget_allows(size_t bytes);
+
+// aligned only as much as Type needs, so strings are packed byte by byte
 #define ARENA_ALLOC(Type, count) \
-    ((Type*)arena_alloc((count) * sizeof(Type)))
+    ((Type*)arena_alloc_aligned((count) * sizeof(Type), alignof(Type)))
+
+#define ARENA_ALLOC_IN(arena, Type, count) \
+    ((Type*)arena_alloc_aligned_in((arena), (count) * sizeof(Type), alignof(Type)))
+
+/*
+A handle names an object in g_arena in 32 bits, as its offset in
+units of ARENA_HANDLE_GRANULE, which spans the whole reservation.
+Structures allocated once per source character hold handles where
+they would otherwise hold pointers. Handle 0 names nothing, as the
+first unit of g_arena is never handed out. Only types aligned to
+the granule can have handles.
+*/
+#define ARENA_HANDLE_GRANULE 8
+
+static inline u32 arena_handle(void* pointer) {
+    if (pointer == nullptr) {
+        return 0;
+    }
+
+    return (u32)(((u8*)pointer - g_arena.heap) / ARENA_HANDLE_GRANULE);
+}
+
+static inline void* arena_resolve(u32 handle) {
+    if (handle == 0) {
+        return nullptr;
+    }
+
+    return g_arena.heap + (size_t)handle * ARENA_HANDLE_GRANULE;
+}
+
+// declares TypeHandle with name_handle() and name_resolve() to convert to and from Type*
+#define ARENA_HANDLE(Type, name)                                        \
+    static_assert(alignof(Type) >= ARENA_HANDLE_GRANULE);               \
+                                                                        \
+    typedef struct Type##Handle {                                       \
+        u32 index;                                                      \
+    } Type##Handle;                                                     \
+                                                                        \
+    static inline Type##Handle name##_handle(Type* pointer) {           \
+        return (Type##Handle){.index = arena_handle(pointer)};          \
+    }                                                                   \
+                                                                        \
+    static inline Type* name##_resolve(Type##Handle handle) {           \
+        return (Type*)arena_resolve(handle.index);                      \
+    }
 
 #endif  // ARENA_H
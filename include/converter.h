@@ -6,6 +6,6 @@
 typedef struct ConvertedToken ConvertedToken;
 typedef struct ConvertedTokenVector ConvertedTokenVector;
 
-ConvertedTokenVector* convert(ExpandedTokenVector* expanded_tokens);
+ConvertedTokenVector* convert(ExpandedTokenRope* expanded_tokens);
 
 #endif  // CONVERTER_H
@@ -0,0 +1,14 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include "types.h"
+
+#define CPU_FEATURE_AVX2 (1u << 0)
+#define CPU_FEATURE_AVX512BW (1u << 1)
+
+// the instruction sets both the processor and the kernel support, set by cpu_init
+extern u32 g_cpu_features;
+
+void cpu_init(void);
+
+#endif  // CPU_H
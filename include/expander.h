@@ -3,30 +3,71 @@
 
 #include "tokenizer.h"
 
+/*
+A macro's replacement list is compiled once at #define time
+into a flat sequence of ops, so that substitution never has
+to look at parameter names again.
+*/
+typedef enum MacroOpKind {
+    MACRO_OP_LITERAL,        // copy `token` as it is
+    MACRO_OP_PARAM,          // substitute argument number `operand`
+    MACRO_OP_VA_ARGS,        // substitute the variable arguments
+    MACRO_OP_VA_OPT_BEGIN,   // `operand` is the index of the matching end
+    MACRO_OP_VA_OPT_END,     // `operand` is 1 if `#` spells the group as a string literal
+    MACRO_OP_STRINGIZE,      // `#`, spell argument number `operand` as a string literal
+    MACRO_OP_PASTE,          // `##`, join the ops on either side into one token
+} MacroOpKind;
+
+typedef struct MacroOp {
+    MacroOpKind kind;
+    size_t operand;
+
+    // the token inside the #define this op was compiled from
+    PPToken* token;
+} MacroOp;
+
+typedef struct MacroOpVector {
+    MacroOp* data;
+
+    size_t count;
+    size_t capacity;
+} MacroOpVector;
+
+// the macros the implementation defines itself, C23 6.10.10
+typedef enum PredefinedMacroKind {
+    PREDEFINED_NONE,      // an ordinary #define
+    PREDEFINED_CONSTANT,  // always the same token
+    PREDEFINED_FILE,
+    PREDEFINED_LINE,
+    PREDEFINED_COUNTER,
+    PREDEFINED_DATE,
+} PredefinedMacroKind;
+
 typedef struct MacroDefinition {
     char* name;
+    u32 id;  // unique among all definitions, hide sets refer to macros by it
+
+    // Predefined macros have neither parameters
+    // nor a replacement list, nor a body.
+    PredefinedMacroKind predefined;
 
     bool is_function_like;
     PPTokenVector* params;
     bool is_variadic;
 
     PPTokenVector* replacement_list;
-} MacroDefinition;
-
-typedef struct PPTokenVectorVector {
-    PPTokenVector** data;
-    size_t count;
-    size_t capacity;
-} PPTokenVectorVector;
+    MacroOpVector* body;
 
-typedef struct MacroInvocation {
-    MacroDefinition* definition;
+    // of the parameter names and the replacement list, equal for
+    // any two definitions that may legally replace each other
+    u64 fingerprint;
+} MacroDefinition;
 
-    PPToken* origin;
+// interned set of macro ids, nullptr is the empty set
+typedef struct HideSet HideSet;
 
-    PPTokenVectorVector* arguments;
-    bool are_va_args_present;
-} MacroInvocation;
+// forward declaration
+typedef struct MacroInvocation MacroInvocation;
 
 typedef struct ExpandedToken {
     PPTokenKind kind;
@@ -42,7 +83,13 @@ typedef struct ExpandedToken {
     // 2. The Logical Source (Expansion History)
     // If this token appeared because of a macro, this points to that call.
     // NULL if this token appeared directly in the source code.
+    // Set once when the token is made, the calls it is nested
+    // in are reached through MacroInvocation::parent.
     MacroInvocation* invocation;
+
+    // 3. The macros this token may no longer invoke (Prosser's hide set).
+    // Only kept up to date on identifiers and `)`.
+    HideSet* hide_set;
 } ExpandedToken;
 
 typedef struct ExpandedTokenVector {
@@ -52,6 +99,67 @@ typedef struct ExpandedTokenVector {
     size_t capacity;
 } ExpandedTokenVector;
 
-ExpandedTokenVector* expand(PPTokenVector* pp_tokens);
+typedef struct ExpandedTokenVectorVector {
+    ExpandedTokenVector** data;
+    size_t count;
+    size_t capacity;
+} ExpandedTokenVectorVector;
+
+typedef struct MacroInvocation {
+    MacroDefinition* definition;
+
+    PPToken* origin;
+
+    // the call that produced this call's macro name,
+    // NULL if the name appeared directly in the source code
+    MacroInvocation* parent;
+
+    // as written, only kept around for the `#` and `##` operands
+    ExpandedTokenVectorVector* arguments;
+    bool are_va_args_present;
+
+    // fully macro-expanded on first use, nullptr until then
+    ExpandedTokenVectorVector* expanded_arguments;
+} MacroInvocation;
+
+/*
+A whole expanded translation unit: a rope of fixed-size blocks,
+so that every token is written exactly once, and growing the
+output never copies what is already there.
+*/
+#define EXPANDED_TOKEN_BLOCK_SIZE 1024
+
+typedef struct ExpandedTokenBlock {
+    ExpandedToken* data[EXPANDED_TOKEN_BLOCK_SIZE];
+    size_t count;
+
+    struct ExpandedTokenBlock* next;
+} ExpandedTokenBlock;
+
+typedef struct ExpandedTokenRope {
+    ExpandedTokenBlock* head;
+    ExpandedTokenBlock* tail;
+
+    size_t count;
+} ExpandedTokenRope;
+
+/*
+Pull-based preprocessing: each call hands out the next fully
+expanded token of the translation unit, nullptr at its end.
+Files are lexed a line at a time as they are reached, included
+ones are dropped once they run out, and nothing past the
+current line is materialized.
+*/
+typedef struct PPContext PPContext;
+
+PPContext* pp_create(char* full_path);
+ExpandedToken* pp_next_token(PPContext* ctx);
+
+// -D and -U, to be given in command line order before the first token is pulled
+void pp_define(char* definition);  // `name`, `name=value` or `name(params)=value`
+void pp_undefine(char* name);
+
+// drains the whole translation unit, for stages that want all of it
+void expand(PPContext* ctx, ExpandedTokenRope* output);
 
 #endif  // EXPANDER_H
@@ -27,4 +27,20 @@ void __fprintf_impl(
 #define eprintf(format, ...) \
     fprintf(LINUX_FD_STDERR, (format)__VA_OPT__(, ) __VA_ARGS__)
 
+/*
+Writes are buffered per file descriptor. stderr is flushed at the
+end of every eprintf, after everything else, so that a diagnostic
+never overtakes the output that came before it.
+*/
+void io_write(s32 fd, char* buf, size_t len);
+
+// like io_write, but buf is not copied and must stay as it is until flushed
+void io_write_borrowed(s32 fd, char* buf, size_t len);
+
+void io_flush(s32 fd);
+void io_flush_all(void);
+
+// the bytes as decimal integer literals separated by commas, as #embed expands
+void print_byte_list(s32 fd, u8* bytes, size_t count);
+
 #endif  // IO_H
@@ -0,0 +1,27 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include "tokenizer.h"
+
+/*
+Runs the read, normalize, splice and tokenize stages over one
+included file lazily, a logical line at a time, so that only the
+lines the expander actually reaches are ever turned into tokens.
+*/
+typedef struct Lexer {
+    FileInclusion* inclusion;
+
+    // first byte of the file that has not been lexed yet,
+    // always the start of a line
+    size_t offset;
+
+    // the file has been lexed to its end and its contents released
+    bool is_finished;
+} Lexer;
+
+Lexer* lexer_create(char* full_path, PPToken* inclusion_trigger);
+Lexer* lexer_create_from_inclusion(FileInclusion* inclusion);
+bool lexer_lex_line(Lexer* lexer, PPTokenVector* pptokens);
+void lexer_skip_group(Lexer* lexer);
+
+#endif  // LEXER_H
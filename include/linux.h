@@ -9,21 +9,39 @@
 #define LINUX_FD_STDOUT ((s32)1)
 #define LINUX_FD_STDERR ((s32)2)
 
-#define LINUX_BRK_CURRENT ((u8*)0)
-
 #define LINUX_FILE_FLAG_READONLY 0
 #define LINUX_FILE_FLAG_WRITEONLY 1
 #define LINUX_FILE_FLAG_READWRITE 2
 #define LINUX_FILE_FLAG_CREAT 64
+#define LINUX_FILE_FLAG_TRUNC 512
 
 #define LINUX_FILE_MODE_USER_RW 438
 
+#define LINUX_PROT_NONE 0
+#define LINUX_PROT_READ 1
+#define LINUX_PROT_WRITE 2
+#define LINUX_MAP_PRIVATE 2
+#define LINUX_MAP_FIXED 16
+#define LINUX_MAP_ANONYMOUS 32
+#define LINUX_MAP_NORESERVE 16384
+
+#define LINUX_MADV_DONTNEED 4
+#define LINUX_MADV_HUGEPAGE 14
+
+// mmap returns -errno on failure, which is never a valid address
+#define LINUX_MMAP_FAILED(pointer) ((u64)(pointer) > (u64)-4096)
+
 [[noreturn]] void linux_exit(u8 code);
 s64 linux_write(s32 fd, char* buf, size_t len);
-// guaraantees zeroed out pages on first request
-// which will be our only request since we dont free
-u8* linux_brk(u8* ptr);
 
+typedef struct {
+    void* iov_base;
+    size_t iov_len;
+} linux_iovec_t;
+
+// writes the buffers one after the other, at most LINUX_IOV_MAX of them
+#define LINUX_IOV_MAX 1024
+s64 linux_writev(s32 fd, linux_iovec_t* iov, s32 iovcnt);
 typedef struct {
     u64 st_dev;
     u64 st_ino;
@@ -50,4 +68,12 @@ s64 linux_close(s32 fd);
 s64 linux_read(s32 fd, u8* buf, size_t len);
 s64 linux_fstat(s32 fd, linux_stat_t* stat);
 
+// seconds since the epoch
+s64 linux_time(void);
+
+u8* linux_mmap(u8* address, size_t length, s32 prot, s32 flags, s32 fd, s64 offset);
+s64 linux_munmap(u8* address, size_t length);
+s64 linux_mprotect(u8* address, size_t length, s32 prot);
+s64 linux_madvise(u8* address, size_t length, s32 advice);
+
 #endif  //  LINUX_H
@@ -2,18 +2,24 @@
 #define NORMALIZER_H
 
 #include "reader.h"
+#include "vector.h"
 
 /*
 UTF-32 is chosen as the source character set
 as per section 5.2.1 (Character sets) of the
 C standard ISO/IEC 9899:2024.
 */
+// the one to four bytes a character was encoded in
+typedef SMALL_VECTOR(ByteHandle, 4) SmallByteVector;
+
 typedef struct SourceChar {
     u32 value;
 
-    ByteVector* origin;
+    SmallByteVector origin;
 } SourceChar;
 
+ARENA_HANDLE(SourceChar, source_char)
+
 typedef struct SourceCharVector {
     SourceChar** data;
 
@@ -21,6 +27,6 @@ typedef struct SourceCharVector {
     size_t capacity;
 } SourceCharVector;
 
-SourceCharVector* normalize(ByteVector* bytes);
+SourceCharVector* normalize(ByteVector* bytes, Arena* scratch);
 
 #endif  // NORMALIZER_H
@@ -5,13 +5,16 @@
 #include "linux.h"
 #include "reader.h"
 
+// flushes what is buffered, so the diagnostic is not lost, and exits with failure
+[[noreturn]] void panic_exit(void);
+
 #define panic(format, ...)                           \
     do {                                             \
         eprintf("mcc: error: ");                     \
         eprintf((format)__VA_OPT__(, ) __VA_ARGS__); \
         eprintf("\n");                               \
                                                      \
-        linux_exit(LINUX_EXIT_FAILURE);              \
+        panic_exit();                                \
     } while (0)
 
 #define print_header(loc, format, ...)                                  \
@@ -32,19 +35,35 @@ void print_snippet(FileDefinition* def, size_t line);
 void print_caret(size_t line, size_t col);
 void print_include_trace(FileInclusion* inclusion);
 
-#define panic_byte(byte, format, ...)                          \
-    do {                                                       \
-        print_include_trace((byte)->origin);                   \
-        Location loc = byte_get_location((byte));              \
-                                                               \
-        print_header(loc, (format)__VA_OPT__(, ) __VA_ARGS__); \
-        print_snippet((byte)->origin->definition, loc.line);   \
-        print_caret(loc.line, loc.col);                    \
-                                                               \
-        linux_exit(LINUX_EXIT_FAILURE);                        \
+// forward declaration
+typedef struct MacroInvocation MacroInvocation;
+
+void print_expansion_trace(MacroInvocation* invocation);
+
+#define panic_byte(byte, format, ...)                                           \
+    do {                                                                        \
+        Byte* _byte = (byte);                                                   \
+        FileInclusion* _inclusion = file_inclusion_resolve(_byte->origin);      \
+        print_include_trace(_inclusion);                                        \
+        Location loc = byte_get_location(_byte);                                \
+                                                                                \
+        print_header(loc, (format)__VA_OPT__(, ) __VA_ARGS__);                  \
+        print_snippet(_inclusion->definition, loc.line);                        \
+        print_caret(loc.line, loc.col);                                         \
+                                                                                \
+        panic_exit();                                                           \
     } while (0)
 
 #define panic_sourcechar(sourcechar, format, ...) \
-    panic_byte((sourcechar)->origin->data[0], (format)__VA_OPT__(, ) __VA_ARGS__)
+    panic_byte(byte_resolve((sourcechar)->origin.data[0]), (format)__VA_OPT__(, ) __VA_ARGS__)
+
+#define panic_pptoken(pptoken, format, ...) \
+    panic_byte(pptoken_first_byte(pptoken), (format)__VA_OPT__(, ) __VA_ARGS__)
+
+#define panic_invocation(invocation, format, ...)                                \
+    do {                                                                         \
+        print_expansion_trace((invocation)->parent);                             \
+        panic_pptoken((invocation)->origin, (format)__VA_OPT__(, ) __VA_ARGS__); \
+    } while (0)
 
 #endif  // PANIC_H
@@ -1,6 +1,7 @@
 #ifndef READER_H
 #define READER_H
 
+#include "arena.h"
 #include "types.h"
 
 // forward declaration
@@ -11,8 +12,14 @@ typedef struct PPToken PPToken;
 typedef struct FileDefinition {
     char* full_path;
 
+    // followed by a NUL, nullptr while released, see file_content
     u8* content;
     size_t size;
+
+    // mapped from the file rather than read, and so can be released
+    bool is_mapped;
+    // lexers still working through the file
+    size_t readers;
 } FileDefinition;
 
 // one #include instance
@@ -22,14 +29,18 @@ typedef struct FileInclusion {
     PPToken* inclusion_trigger;
 } FileInclusion;
 
+ARENA_HANDLE(FileInclusion, file_inclusion)
+
 // smart byte, points to its FileInclusion instance
 typedef struct Byte {
     u8 value;
 
-    FileInclusion* origin;
+    FileInclusionHandle origin;
     size_t offset;
 } Byte;
 
+ARENA_HANDLE(Byte, byte)
+
 typedef struct ByteVector {
     Byte** data;
 
@@ -37,6 +48,22 @@ typedef struct ByteVector {
     size_t capacity;
 } ByteVector;
 
-ByteVector* read(char* full_path, PPToken* inclusion_trigger);
+FileInclusion* read(char* full_path, PPToken* inclusion_trigger);
+
+// text that is in no file, such as the -D options, named name in diagnostics
+FileInclusion* read_memory(char* name, char* content);
+ByteVector* read_bytes(FileInclusion* inclusion, size_t start, size_t end, Arena* scratch);
+
+/*
+In low memory mode, files are mapped rather than read, and their
+contents are released as soon as no lexer needs them any more; the
+tokens keep copies of their spellings. Anything that looks at the
+contents afterwards, diagnostics first of all, goes through
+file_content, which maps the file again.
+*/
+void reader_enable_low_memory(void);
+u8* file_content(FileDefinition* definition);
+void file_acquire(FileDefinition* definition);
+void file_release(FileDefinition* definition);
 
 #endif  // READER_H
@@ -3,12 +3,15 @@
 
 #include "normalizer.h"
 
+// aligned so that it can have a handle
 typedef struct SplicedChar {
-    u32 value;
+    alignas(ARENA_HANDLE_GRANULE) u32 value;
 
-    SourceChar* source_char;
+    SourceCharHandle source_char;
 } SplicedChar;
 
+ARENA_HANDLE(SplicedChar, spliced_char)
+
 typedef struct SplicedCharVector {
     SplicedChar** data;
 
@@ -16,6 +19,9 @@ typedef struct SplicedCharVector {
     size_t capacity;
 } SplicedCharVector;
 
-SplicedCharVector* splice(SourceCharVector* source_chars);
+// the characters of a token, which few have more of than this
+typedef SMALL_VECTOR(SplicedCharHandle, 8) SmallSplicedCharVector;
+
+SplicedCharVector* splice(SourceCharVector* source_chars, Arena* scratch);
 
 #endif  // SPLICER_H
@@ -3,6 +3,10 @@
 
 #include "types.h"
 
+// picks the widest kernels the processor runs, after cpu_init
+void string_init(void);
+char* string_kernels_name(void);
+
 size_t strlen(char* cstr);
 bool streq(char* cstr1, char* cstr2);
 char* strcat(char* cstr1, char* cstr2);
@@ -11,5 +15,10 @@ char* strdup(char* cstr);
 
 void memcpy(void* dest, void* src, size_t num_bytes);
 void* memset(void* ptr, int value, size_t num);
+void* memchr(void* ptr, int value, size_t num);
+void* memrchr(void* ptr, int value, size_t num);
+
+// the first byte that is one of the at most 8 bytes in set
+void* memchr_any(void* ptr, char* set, size_t num);
 
 #endif  // STRING_H
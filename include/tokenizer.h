@@ -13,15 +13,17 @@ typedef enum PPTokenKind {
     PP_HEADERNAME,      // <stdio.h>
     PP_OTHER,           // @
     PP_NEWLINE,
+    PP_EMBED,           // #embed data, spelling points at `length` raw bytes
     PP_EOF
 } PPTokenKind;
 
 typedef struct PPToken {
     PPTokenKind kind;
+    bool is_comment;  // a PP_WHITESPACE written as a comment
     char* spelling;
     size_t length;
 
-    SplicedCharVector* origin;
+    SmallSplicedCharVector origin;
 } PPToken;
 
 typedef struct PPTokenVector {
@@ -31,7 +33,13 @@ typedef struct PPTokenVector {
     size_t capacity;
 } PPTokenVector;
 
-PPTokenVector* tokenize(SplicedCharVector* spliced_chars);
+// typical for C, counting whitespace and newlines as tokens of their own
+#define TOKENIZER_BYTES_PER_TOKEN 3
+
+PPTokenVector* tokenize(SplicedCharVector* spliced_chars, Arena* scratch);
+PPToken* retokenize(char* spelling, SplicedChar* location);
 bool pptoken_is(PPToken* pptoken, PPTokenKind kind, char* spelling);
+Byte* pptoken_first_byte(PPToken* pptoken);
+Byte* pptoken_last_byte(PPToken* pptoken);
 
 #endif  // TOKENIZER_H
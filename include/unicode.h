@@ -13,5 +13,6 @@ bool is_XID_Start(u32 codepoint);
 bool is_XID_Continue(u32 codepoint);
 bool is_inline_whitespace(u32 codepoint);
 bool is_hex_digit(u32 codepoint);
+u32 decode_UTF8(char** cursor);
 
 #endif  // UNICODE_H
@@ -2,5 +2,6 @@
 #define UTILS_H
 
 #define UTILS_MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define UTILS_MIN(a, b) (((a) < (b)) ? (a) : (b))
 
 #endif  // UTILS_H
@@ -4,6 +4,41 @@
 #include "arena.h"
 #include "string.h"  // Required for memcpy
 
+// -----------------------------------------------------------------------------
+// The Growth Macro
+// -----------------------------------------------------------------------------
+// Gives the vector room for new_cap elements. A buffer that is the last
+// allocation of the arena just grows in place, any other one is moved.
+// The inline storage of a small vector is part of the struct around it,
+// so it is always moved, even when that struct ends the arena.
+// -----------------------------------------------------------------------------
+
+#define vector_grow_in(arena, vec, new_cap)                                                      \
+    do {                                                                                         \
+        size_t _elem_size = sizeof(*((vec)->data));                                              \
+        bool _is_inline = (u64)(vec)->data >= (u64)(vec) && (u64)(vec)->data < (u64)((vec) + 1); \
+                                                                                                 \
+        /* 1. Extend In Place if the buffer ends the arena */                                    \
+        if (_is_inline ||                                                                        \
+            !arena_try_extend_in((arena), (vec)->data,                                           \
+                                 (vec)->capacity * _elem_size, (new_cap) * _elem_size)) {        \
+            /* 2. Allocate New Block (using the type of the existing data) */                    \
+            /* typeof(*((vec)->data)) gives us the struct type (e.g., Byte) */                   \
+            typeof((vec)->data) _new_data = ARENA_ALLOC_IN((arena), typeof(*((vec)->data)),      \
+                                                           (new_cap));                           \
+                                                                                                 \
+            /* 3. Copy Old Data (if any) */                                                      \
+            if ((vec)->count > 0) {                                                              \
+                memcpy(_new_data, (vec)->data, (vec)->count * _elem_size);                       \
+            }                                                                                    \
+                                                                                                 \
+            /* 4. Update Vector (Old memory is left in Arena, no free needed) */                 \
+            (vec)->data = _new_data;                                                             \
+        }                                                                                        \
+                                                                                                 \
+        (vec)->capacity = (new_cap);                                                             \
+    } while (0)
+
 // -----------------------------------------------------------------------------
 // The "By Value" Vector Macro
 // -----------------------------------------------------------------------------
@@ -11,30 +46,81 @@
 //    ByteVector* vec = ARENA_ALLOC(ByteVector, 1);
 //    Byte b = { .value = 10 };
 //    vector_push(vec, b);
+//
+// vector_push_in(arena, vec, val) grows the vector inside the given arena
+// -----------------------------------------------------------------------------
+
+#define vector_push_in(arena, vec, val)                                                \
+    do {                                                                               \
+        /* 1. Check Capacity */                                                        \
+        if ((vec)->count >= (vec)->capacity) {                                         \
+            size_t _new_cap = (vec)->capacity == 0 ? 4 : (vec)->capacity * 2;          \
+            vector_grow_in((arena), (vec), _new_cap);                                  \
+        }                                                                              \
+                                                                                       \
+        /* 2. Push Value */                                                            \
+        (vec)->data[(vec)->count++] = (val);                                           \
+    } while (0)
+
+#define vector_push(vec, val) vector_push_in(&g_arena, vec, val)
+
+// -----------------------------------------------------------------------------
+// The Reserve Macro
+// -----------------------------------------------------------------------------
+// Usage:
+//    vector_reserve(tokens_vec, expected_count);
+//
+// A capacity hint, so that a vector whose final size can be guessed
+// does not go through every doubling on its way there.
 // -----------------------------------------------------------------------------
 
-#define vector_push(vec, val)                                                              \
-    do {                                                                                   \
-        /* 1. Check Capacity */                                                            \
-        if ((vec)->count >= (vec)->capacity) {                                             \
-            size_t _new_cap = (vec)->capacity == 0 ? 4 : (vec)->capacity * 2;              \
-                                                                                           \
-            /* 2. Allocate New Block (using the type of the existing data) */              \
-            /* typeof(*((vec)->data)) gives us the struct type (e.g., Byte) */             \
-            typeof((vec)->data) _new_data = ARENA_ALLOC(typeof(*((vec)->data)), _new_cap); \
-                                                                                           \
-            /* 3. Copy Old Data (if any) */                                                \
-            if ((vec)->count > 0) {                                                        \
-                memcpy(_new_data, (vec)->data, (vec)->count * sizeof(*((vec)->data)));     \
-            }                                                                              \
-                                                                                           \
-            /* 4. Update Vector (Old memory is left in Arena, no free needed) */           \
-            (vec)->data = _new_data;                                                       \
-            (vec)->capacity = _new_cap;                                                    \
-        }                                                                                  \
-                                                                                           \
-        /* 5. Push Value */                                                                \
-        (vec)->data[(vec)->count++] = (val);                                               \
+#define vector_reserve_in(arena, vec, min_cap)                                         \
+    do {                                                                               \
+        size_t _min_cap = (min_cap);                                                   \
+        if (_min_cap > (vec)->capacity) {                                              \
+            vector_grow_in((arena), (vec), _min_cap);                                  \
+        }                                                                              \
+    } while (0)
+
+#define vector_reserve(vec, min_cap) vector_reserve_in(&g_arena, vec, min_cap)
+
+// -----------------------------------------------------------------------------
+// The Small Vector
+// -----------------------------------------------------------------------------
+// Usage:
+//    typedef SMALL_VECTOR(ByteHandle, 4) SmallByteVector;
+//    SmallByteVector* vec = &source_char->origin;
+//    small_vector_init(vec);
+//    vector_push(vec, byte_handle(byte));
+//
+// Holds up to N elements inside itself and only moves to the arena past
+// that, which suits vectors embedded by value that are nearly always tiny.
+// Every vector macro works on it. One left zeroed instead of initialized
+// is a plain vector that allocates on its first push.
+// -----------------------------------------------------------------------------
+
+#define SMALL_VECTOR(T, N) \
+    struct {               \
+        T* data;           \
+        size_t count;      \
+        size_t capacity;   \
+        T inline_data[N];  \
+    }
+
+#define small_vector_init(vec)                                                              \
+    do {                                                                                    \
+        (vec)->data = (vec)->inline_data;                                                   \
+        (vec)->count = 0;                                                                   \
+        (vec)->capacity = sizeof((vec)->inline_data) / sizeof(*((vec)->inline_data));      \
+    } while (0)
+
+// a plain struct copy would leave data pointing into the source's inline storage
+#define small_vector_copy(dest, src)                                                        \
+    do {                                                                                    \
+        *(dest) = *(src);                                                                   \
+        if ((src)->data == (src)->inline_data) {                                            \
+            (dest)->data = (dest)->inline_data;                                             \
+        }                                                                                   \
     } while (0)
 
 // -----------------------------------------------------------------------------
@@ -53,21 +139,10 @@
         if (_req_count > (dest)->capacity) {                                                           \
             size_t _new_cap = (dest)->capacity == 0 ? 16 : (dest)->capacity;                           \
             while (_new_cap < _req_count) _new_cap *= 2;                                               \
-                                                                                                       \
-            /* 3. Allocate New Block */                                                                \
-            typeof((dest)->data) _new_data = ARENA_ALLOC(typeof(*((dest)->data)), _new_cap);           \
-                                                                                                       \
-            /* 4. Copy Old Data (if any) */                                                            \
-            if ((dest)->count > 0) {                                                                   \
-                memcpy(_new_data, (dest)->data, (dest)->count * sizeof(*((dest)->data)));              \
-            }                                                                                          \
-                                                                                                       \
-            /* 5. Update Vector */                                                                     \
-            (dest)->data = _new_data;                                                                  \
-            (dest)->capacity = _new_cap;                                                               \
+            vector_grow_in(&g_arena, (dest), _new_cap);                                                \
         }                                                                                              \
                                                                                                        \
-        /* 6. Append New Data */                                                                       \
+        /* 3. Append New Data */                                                                       \
         if ((src)->count > 0) {                                                                        \
             memcpy((dest)->data + (dest)->count, (src)->data, (src)->count * sizeof(*((dest)->data))); \
             (dest)->count = _req_count;                                                                \
@@ -1,70 +1,260 @@
 #include <arena.h>
 #include <linux.h>
 #include <panic.h>
+#include <string.h>
 #include <utils.h>
 
 #define ARENA_KiB(x) ((x) << 10)
 #define ARENA_MiB(x) ((x) << 20)
-#define ARENA_SIZE_DEFAULT (ARENA_MiB(1))
+#define ARENA_GiB(x) ((size_t)(x) << 30)
+#define ARENA_SIZE_DEFAULT (ARENA_MiB(2))
+// as much as 32-bit handles can reach, which only g_arena needs
+#define ARENA_HANDLE_RESERVE_SIZE (ARENA_GiB(4) * ARENA_HANDLE_GRANULE)
+// for the scratch arenas, which handles never point into
+#define ARENA_SCRATCH_RESERVE_SIZE (ARENA_GiB(1))
+// a reservation the address space limit refuses is retried halved, down to this
+#define ARENA_RESERVE_SIZE_MIN (ARENA_MiB(8))
+#define ARENA_HUGE_PAGE_SIZE (ARENA_MiB(2))
+#define ARENA_PAGE_SIZE (ARENA_KiB(4))
+#define ARENA_RELEASE_THRESHOLD (ARENA_MiB(1))
 #define ARENA_ALIGNMENT_BYTES (alignof(max_align_t))
-#define ARENA_ALIGN_UP(number) \
-    (((number) + ARENA_ALIGNMENT_BYTES - 1) & ~(ARENA_ALIGNMENT_BYTES - 1))
+#define ARENA_ALIGN_UP(number, alignment) \
+    (((number) + (alignment) - 1) & ~((alignment) - 1))
+#define ARENA_HUGE_PAGE_ALIGN_UP(number) \
+    (((number) + ARENA_HUGE_PAGE_SIZE - 1) & ~(ARENA_HUGE_PAGE_SIZE - 1))
+#define ARENA_PAGE_ALIGN_UP(number) \
+    (((number) + ARENA_PAGE_SIZE - 1) & ~(ARENA_PAGE_SIZE - 1))
+#define ARENA_PAGE_ALIGN_DOWN(number) ((number) & ~(ARENA_PAGE_SIZE - 1))
 
-typedef struct Arena {
-    size_t capacity;
-    size_t position;
-    u8* heap;
-} Arena;
+// 0 for no budget
+static size_t g_budget = 0;
 
-static Arena arena = {
+// committed by all arenas together with what was charged to them
+static size_t g_committed = 0;
+
+/*
+The heap is one range of address space reserved up front without
+any access, so it costs nothing until used. The front of it is made
+accessible as the arena fills, in steps that double each time, and
+the kernel is asked to back it with huge pages. Every arena has a
+range of its own. Only g_arena reserves all that handles can reach,
+and under a limit on address space every arena makes do with less.
+*/
+Arena g_arena = {
     .heap = nullptr,
+    .reserved = 0,
     .capacity = 0,
     .position = 0,
 };
 
-static u8* arena_ask_os_for_mem(size_t request) {
-    // get current break
-    u8* curr_brk = linux_brk(LINUX_BRK_CURRENT);
+// reserves up to size bytes for the arena, halving the request while it is refused
+static void arena_reserve(Arena* arena, size_t size) {
+    s32 flags = LINUX_MAP_PRIVATE | LINUX_MAP_ANONYMOUS | LINUX_MAP_NORESERVE;
 
-    size_t req_aligned = ARENA_ALIGN_UP(request);
-    u8* next_brk_req = curr_brk + req_aligned;
+    while (true) {
+        // the extra huge page lets the start be moved onto a huge page boundary
+        size_t request = size + ARENA_HUGE_PAGE_SIZE;
 
-    // ask for memory
-    u8* next_brk = linux_brk(next_brk_req);
+        u8* mapping = linux_mmap(nullptr, request, LINUX_PROT_NONE, flags, -1, 0);
+        if (!LINUX_MMAP_FAILED(mapping)) {
+            arena->heap = (u8*)ARENA_HUGE_PAGE_ALIGN_UP((u64)mapping);
+            arena->reserved = size;
+            break;
+        }
 
-    // handle OS refusal
-    if (next_brk != next_brk_req) panic("out of memory");
+        if (size / 2 < ARENA_RESERVE_SIZE_MIN) panic("failed to reserve memory for the arena");
+        size /= 2;
+    }
 
-    return curr_brk;
+    // huge pages are only a hint, the arena works the same without them
+    linux_madvise(arena->heap, arena->reserved, LINUX_MADV_HUGEPAGE);
 }
 
-static void arena_grow(size_t needed_size) {
-    size_t request = UTILS_MAX(needed_size, ARENA_SIZE_DEFAULT);
-    arena_ask_os_for_mem(request);
-    arena.capacity += request;
+// makes the first `capacity` bytes of the heap usable, which the kernel hands out zeroed
+static void arena_commit(Arena* arena, size_t capacity) {
+    if (capacity > arena->reserved) panic("out of memory");
+    arena_charge((s64)(capacity - arena->capacity));
+
+    s64 result = linux_mprotect(
+        arena->heap + arena->capacity,
+        capacity - arena->capacity,
+        LINUX_PROT_READ | LINUX_PROT_WRITE
+    );
+    if (result != 0) panic("out of memory");
+
+    arena->capacity = capacity;
+}
+
+// gives back everything from `capacity` on, which must hold nothing
+static void arena_decommit(Arena* arena, size_t capacity) {
+    if (capacity >= arena->capacity) return;
+
+    u8* start = arena->heap + capacity;
+    size_t size = arena->capacity - capacity;
+
+    linux_madvise(start, size, LINUX_MADV_DONTNEED);
+    linux_mprotect(start, size, LINUX_PROT_NONE);
+
+    arena_charge(-(s64)size);
+    arena->capacity = capacity;
+}
+
+static void arena_grow(Arena* arena, size_t needed_size) {
+    size_t needed = arena->position + needed_size;
+    size_t capacity = UTILS_MAX(needed, arena->capacity * 2);
+
+    // under a budget, growth is page-granular and the doubling stops short of it while what is needed still fits
+    if (g_budget != 0) {
+        size_t left = g_budget > g_committed ? g_budget - g_committed : 0;
+        size_t allowed = ARENA_PAGE_ALIGN_DOWN(arena->capacity + left);
+        capacity = UTILS_MAX(ARENA_PAGE_ALIGN_UP(needed), UTILS_MIN(ARENA_PAGE_ALIGN_UP(capacity), allowed));
+    }
+
+    else {
+        capacity = ARENA_HUGE_PAGE_ALIGN_UP(capacity);
+    }
+
+    // a reservation cut short by an address space limit caps the doubling, not what is needed
+    if (needed > arena->reserved) panic("out of memory");
+    capacity = UTILS_MIN(capacity, arena->reserved);
+
+    arena_commit(arena, capacity);
+}
+
+static void arena_setup(Arena* arena, size_t reserve_size) {
+    arena_reserve(arena, reserve_size);
+    arena->capacity = 0;
+    arena->position = 0;
+
+    // under a budget, an arena starts at a single page so that small budgets fit
+    arena_commit(arena, g_budget != 0 ? ARENA_PAGE_SIZE : ARENA_SIZE_DEFAULT);
 }
 
 void arena_init(void) {
-    u8* heap_start = arena_ask_os_for_mem(ARENA_SIZE_DEFAULT);
+    arena_setup(&g_arena, ARENA_HANDLE_RESERVE_SIZE);
+
+    // taken so that no object has handle 0
+    arena_alloc_aligned(ARENA_HANDLE_GRANULE, 1);
+}
+
+// alignment must be a power of two, an allocation takes exactly size bytes after it
+void* arena_alloc_aligned_in(Arena* arena, size_t size, size_t alignment) {
+    if (arena->heap == nullptr) {
+        arena_setup(arena, ARENA_SCRATCH_RESERVE_SIZE);
+    }
+
+    size_t start = ARENA_ALIGN_UP(arena->position, alignment);
+
+    if (start + size > arena->capacity) {
+        arena_grow(arena, start + size - arena->position);
+    }
+
+    arena->position = start + size;
+    arena->unpacked_size += ARENA_ALIGN_UP(size, ARENA_ALIGNMENT_BYTES);
+
+    return (void*)(arena->heap + start);
+}
+
+void* arena_alloc_in(Arena* arena, size_t size) {
+    return arena_alloc_aligned_in(arena, size, ARENA_ALIGNMENT_BYTES);
+}
 
-    arena.capacity = ARENA_SIZE_DEFAULT;
-    arena.position = 0;
-    arena.heap = heap_start;
+void* arena_alloc_aligned(size_t size, size_t alignment) {
+    return arena_alloc_aligned_in(&g_arena, size, alignment);
 }
 
 void* arena_alloc(size_t size) {
-    size_t aligned_size = ARENA_ALIGN_UP(size);
+    return arena_alloc_aligned_in(&g_arena, size, ARENA_ALIGNMENT_BYTES);
+}
 
-    if (arena.position + aligned_size > arena.capacity) {
-        arena_grow(aligned_size);
+/*
+Resizes the allocation at pointer from old_size to new_size bytes
+without moving it, which is possible only while it is the last one
+in the arena. Returns false if it is not, or if pointer is nullptr.
+Bytes given back by shrinking are cleared, like any free memory.
+*/
+bool arena_try_extend_in(Arena* arena, void* pointer, size_t old_size, size_t new_size) {
+    if (pointer == nullptr || (u8*)pointer + old_size != arena->heap + arena->position) {
+        return false;
     }
 
-    u8* pointer = arena.heap + arena.position;
-    arena.position += aligned_size;
+    if (new_size < old_size) {
+        memset((u8*)pointer + new_size, 0, old_size - new_size);
+        arena->position -= old_size - new_size;
+        arena->unpacked_size -= ARENA_ALIGN_UP(old_size, ARENA_ALIGNMENT_BYTES) -
+                                ARENA_ALIGN_UP(new_size, ARENA_ALIGNMENT_BYTES);
+        return true;
+    }
+
+    size_t extra_size = new_size - old_size;
+
+    if (arena->position + extra_size > arena->capacity) {
+        arena_grow(arena, extra_size);
+    }
 
-    return (void*)pointer;
+    arena->position += extra_size;
+    arena->unpacked_size += ARENA_ALIGN_UP(new_size, ARENA_ALIGNMENT_BYTES) -
+                            ARENA_ALIGN_UP(old_size, ARENA_ALIGNMENT_BYTES);
+    return true;
+}
+
+bool arena_try_extend(void* pointer, size_t old_size, size_t new_size) {
+    return arena_try_extend_in(&g_arena, pointer, old_size, new_size);
+}
+
+ArenaMark arena_mark(Arena* arena) {
+    return (ArenaMark){.position = arena->position};
+}
+
+/*
+Everything allocated since mark is dropped. Allocations are handed
+out zeroed, so the memory is cleared again on the way back; past a
+threshold, whole pages are given back to the kernel instead, which
+zeroes them when they are next touched.
+*/
+void arena_rewind(Arena* arena, ArenaMark mark) {
+    if (mark.position > arena->position) panic("arena rewound past its position");
+
+    u8* start = arena->heap + mark.position;
+    u8* end = arena->heap + arena->position;
+
+    if ((size_t)(end - start) >= ARENA_RELEASE_THRESHOLD) {
+        u8* first_page = (u8*)ARENA_PAGE_ALIGN_UP((u64)start);
+        u8* last_page = (u8*)ARENA_PAGE_ALIGN_UP((u64)end);
+
+        memset(start, 0, (size_t)(first_page - start));
+        linux_madvise(first_page, (size_t)(last_page - first_page), LINUX_MADV_DONTNEED);
+    }
+
+    else {
+        memset(start, 0, (size_t)(end - start));
+    }
+
+    arena->position = mark.position;
 }
 
 size_t arena_usage_KiB(void) {
-    return arena.position / ARENA_KiB(1);
+    return g_arena.position / ARENA_KiB(1);
+}
+
+/*
+g_arena is set up before the options are read, so what it committed
+ahead of being used is given back now that the budget is known.
+*/
+void arena_set_budget(size_t bytes) {
+    g_budget = bytes;
+    arena_decommit(&g_arena, ARENA_PAGE_ALIGN_UP(g_arena.position));
+    arena_charge(0);
+}
+
+void arena_charge(s64 bytes) {
+    g_committed += bytes;
+
+    if (g_budget != 0 && g_committed > g_budget) {
+        panic("memory budget of %zu MiB exceeded", g_budget / ARENA_MiB(1));
+    }
+}
+
+bool arena_budget_allows(size_t bytes) {
+    return g_budget == 0 || g_committed + bytes <= g_budget;
 }
@@ -0,0 +1,57 @@
+#include <cpu.h>
+
+#define CPU_LEAF_VENDOR 0
+#define CPU_LEAF_FEATURES 1
+#define CPU_LEAF_EXTENDED_FEATURES 7
+
+#define CPU_ECX_OSXSAVE (1u << 27)
+#define CPU_ECX_AVX (1u << 28)
+#define CPU_EBX_AVX2 (1u << 5)
+#define CPU_EBX_AVX512F (1u << 16)
+#define CPU_EBX_AVX512BW (1u << 30)
+
+// the bits of XCR0 for the register state each instruction set needs saved
+#define CPU_XCR0_AVX_STATE 0x06
+#define CPU_XCR0_AVX512_STATE 0xe0
+
+extern void _cpu_cpuid(u32 leaf, u32 subleaf, u32 registers[4]);
+extern u64 _cpu_xgetbv(u32 index);
+
+u32 g_cpu_features = 0;
+
+/*
+Called from _start before main. An instruction set counts only if
+the kernel also saves its registers across context switches, which
+xgetbv tells; without that, using them would corrupt other threads.
+SSE2 is part of x86-64 and is assumed without asking.
+*/
+void cpu_init(void) {
+    u32 registers[4];  // eax, ebx, ecx, edx
+
+    _cpu_cpuid(CPU_LEAF_VENDOR, 0, registers);
+    if (registers[0] < CPU_LEAF_EXTENDED_FEATURES) {
+        return;
+    }
+
+    _cpu_cpuid(CPU_LEAF_FEATURES, 0, registers);
+    if (!(registers[2] & CPU_ECX_OSXSAVE) || !(registers[2] & CPU_ECX_AVX)) {
+        return;
+    }
+
+    u64 xcr0 = _cpu_xgetbv(0);
+    if ((xcr0 & CPU_XCR0_AVX_STATE) != CPU_XCR0_AVX_STATE) {
+        return;
+    }
+
+    _cpu_cpuid(CPU_LEAF_EXTENDED_FEATURES, 0, registers);
+    u32 extended = registers[1];
+
+    if (extended & CPU_EBX_AVX2) {
+        g_cpu_features |= CPU_FEATURE_AVX2;
+    }
+
+    if ((xcr0 & CPU_XCR0_AVX512_STATE) == CPU_XCR0_AVX512_STATE &&
+        (extended & CPU_EBX_AVX512F) && (extended & CPU_EBX_AVX512BW)) {
+        g_cpu_features |= CPU_FEATURE_AVX512BW;
+    }
+}
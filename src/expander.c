@@ -1,56 +1,220 @@
 #include <arena.h>
 #include <expander.h>
 #include <io.h>
+#include <lexer.h>
 #include <panic.h>
 #include <string.h>
 #include <tokenizer.h>
 #include <types.h>
+#include <unicode.h>
 #include <vector.h>
 
 typedef enum ConditionalState {
-    COND_SKIPPING,
-    COND_ACTIVE,
-    COND_SATISFIED,
+    COND_SKIPPING,   // false so far, a later #elif or #else may still be taken
+    COND_ACTIVE,     // the group being taken
+    COND_SATISFIED,  // an earlier group was taken, or the whole #if sits in a skipped group
 } ConditionalState;
 
+typedef struct Conditional {
+    ConditionalState state;
+    bool is_after_else;
+} Conditional;
+
 typedef struct ConditionalStack {
-    ConditionalState* data;
+    Conditional* data;
     size_t count;
     size_t capacity;
 } ConditionalStack;
 
-typedef struct MacroDefinitionMap {
-    MacroDefinition** data;
+typedef struct MacroTableEntry {
+    char* name;
+    u64 hash;
 
-    size_t count;
+    // nullptr once #undef'd, which also hides a predefined macro
+    MacroDefinition* definition;
+} MacroTableEntry;
+
+// open addressing on the name, a power of two slots, never shrinks
+typedef struct MacroTable {
+    MacroTableEntry* slots;
     size_t capacity;
-} MacroDefinitionMap;
+    size_t count;
+
+    u32 next_id;
+} MacroTable;
+
+/*
+The predefined macros sit in a table of their own that is laid
+out at compile time: each one is in slot hash_string(name) & 15,
+so looking one up costs no more than a miss in the macro table.
+*/
+#define PREDEFINED_MACRO_SLOTS 16
+#define PREDEFINED_MACRO_COUNT 7
+
+typedef struct PredefinedMacro {
+    MacroDefinition definition;
+    u64 hash;
+
+    // what a PREDEFINED_CONSTANT one expands to
+    char* spelling;
+} PredefinedMacro;
+
+#define PREDEFINED_MACRO(macro_id, macro_name, macro_hash, kind, value) \
+    {                                                                    \
+        .definition = {                                                  \
+            .name = (macro_name),                                        \
+            .id = (macro_id),                                            \
+            .predefined = (kind),                                        \
+        },                                                               \
+        .hash = (macro_hash),                                            \
+        .spelling = (value),                                             \
+    }
+
+static PredefinedMacro g_predefined_macros[PREDEFINED_MACRO_SLOTS] = {
+    [0] = PREDEFINED_MACRO(0, "__x86_64__", 0xb9d3917f18b6a240, PREDEFINED_CONSTANT, "1"),
+    [3] = PREDEFINED_MACRO(1, "__COUNTER__", 0x8adfd4ca22d9c7f3, PREDEFINED_COUNTER, nullptr),
+    [5] = PREDEFINED_MACRO(2, "__DATE__", 0x84695ed1106b1265, PREDEFINED_DATE, nullptr),
+    [7] = PREDEFINED_MACRO(3, "__LINE__", 0xff2e9a5d05f1c407, PREDEFINED_LINE, nullptr),
+    [11] = PREDEFINED_MACRO(4, "__FILE__", 0xba5ad919bde9f91b, PREDEFINED_FILE, nullptr),
+    [12] = PREDEFINED_MACRO(5, "__STDC_VERSION__", 0x71097cfc65ebb5ac, PREDEFINED_CONSTANT, "202311L"),
+    [15] = PREDEFINED_MACRO(6, "__STDC__", 0xfcdb88ac5ff69b7f, PREDEFINED_CONSTANT, "1"),
+};
 
 typedef struct ExpanderContext {
     char* LIB_DIR;
     size_t MAX_INCLUDE_DEPTH;
 
-    size_t current_include_depth;
-    MacroDefinitionMap macro_definitions;
+    MacroTable macro_definitions;
     ConditionalStack conditional_stack;
+
+    // bumped by every change to macro_definitions
+    u64 generation;
+
+    // the next value of __COUNTER__
+    u64 counter;
 } ExpanderContext;
 
 typedef struct PPTokenStream {
     PPTokenVector* pptokens;
     size_t current_index;
+
+    // Where the lines of a file come from, nullptr for a fixed list.
+    // pptokens then only holds the lines lexed but not yet consumed.
+    Lexer* lexer;
 } PPTokenStream;
 
+// one lexer state per open file, the innermost #include last
+typedef struct PPTokenStreamStack {
+    PPTokenStream* data;
+    size_t count;
+    size_t capacity;
+} PPTokenStreamStack;
+
+/*
+A pending run of tokens that still has to be rescanned,
+typically the substituted replacement list of a macro.
+Frames are stacked on top of the source token stream, which
+turns the recursion of Prosser's expand() into iteration.
+*/
+typedef struct ExpansionFrame {
+    ExpandedTokenVector* tokens;
+    size_t current_index;
+
+    // added to the hide set of every token read from this frame
+    HideSet* hide_set;
+
+    // a memoized expansion, handed out without being rescanned
+    bool is_expanded;
+
+    // the expansion being memoized while this frame is read, if any
+    struct MemoEntry* recording;
+} ExpansionFrame;
+
+typedef struct ExpansionFrameStack {
+    ExpansionFrame* data;
+    size_t count;
+    size_t capacity;
+} ExpansionFrameStack;
+
+typedef struct Expander {
+    // empty when expanding an isolated list of tokens (an argument)
+    PPTokenStreamStack includes;
+    ExpansionFrameStack frames;
+} Expander;
+
+struct PPContext {
+    Expander expander;
+};
+
+// a name looked up while expanding, and what it named then
+typedef struct MacroDependency {
+    char* name;
+    MacroDefinition* definition;  // nullptr if it was no macro
+} MacroDependency;
+
+// open addressing on the name, a power of two slots
+typedef struct MacroDependencySet {
+    MacroDependency* slots;
+    size_t capacity;
+    size_t count;
+} MacroDependencySet;
+
+/*
+The full expansion of one macro invocation, keyed on the macro,
+the hide set of its frame and the arguments as written. It holds
+as long as every name in dependencies still names the same macro,
+which is only rechecked once generation falls behind.
+*/
+typedef struct MemoEntry {
+    MacroDefinition* definition;
+    HideSet* hide_set;
+    ExpandedTokenVectorVector* arguments;  // nullptr for object-like macros
+    u64 fingerprint;
+
+    // the call that was recorded, replaced by the call being replayed
+    MacroInvocation* invocation;
+
+    ExpandedTokenVector* expansion;
+    MacroDependencySet dependencies;
+    u64 generation;
+
+    struct MemoEntry* next_in_bucket;
+} MemoEntry;
+
+typedef struct ExpansionMemo {
+    MemoEntry** buckets;
+    size_t bucket_count;
+    size_t count;
+
+    // at most one expansion is recorded at a time, by one expander
+    MemoEntry* recording;
+    Expander* recording_expander;
+} ExpansionMemo;
+
+static ExpansionMemo g_memo = {0};
+
 static ExpanderContext g_expander_context = {
     .LIB_DIR = "./include/",
     .MAX_INCLUDE_DEPTH = 15,
 
-    .current_include_depth = 0,
-    .macro_definitions = {0},
+    .macro_definitions = {
+        .slots = nullptr,
+        .capacity = 0,
+        .count = 0,
+        .next_id = PREDEFINED_MACRO_COUNT,
+    },
     .conditional_stack = {0},
+    .generation = 0,
+    .counter = 0,
 };
 
 static void conditional_stack_push(ConditionalStack* stack, ConditionalState state) {
-    vector_push(stack, state);
+    Conditional conditional = {
+        .state = state,
+        .is_after_else = false,
+    };
+
+    vector_push(stack, conditional);
 }
 
 static void conditional_stack_pop(ConditionalStack* stack) {
@@ -67,30 +231,112 @@ static ConditionalState conditional_stack_top(ConditionalStack* stack) {
     }
 
     else {
-        return stack->data[stack->count - 1];
+        return stack->data[stack->count - 1].state;
+    }
+}
+
+static u64 hash_string(char* cstr) {
+    u64 hash = 0xcbf29ce484222325;
+
+    for (; *cstr != '\0'; ++cstr) {
+        hash = (hash ^ (u8)*cstr) * 0x100000001b3;
+    }
+
+    return hash;
+}
+
+static MacroDefinition* predefined_macro_lookup(char* macro_name, u64 hash) {
+    size_t mask = PREDEFINED_MACRO_SLOTS - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        PredefinedMacro* macro = &g_predefined_macros[i];
+
+        if (macro->definition.name == nullptr) {
+            return nullptr;
+        }
+
+        if (macro->hash == hash && streq(macro->definition.name, macro_name)) {
+            return &macro->definition;
+        }
+    }
+}
+
+// the slot of macro_name, or the empty one it would go into
+static MacroTableEntry* macro_table_slot(MacroTable* table, char* macro_name, u64 hash) {
+    size_t mask = table->capacity - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        MacroTableEntry* entry = &table->slots[i];
+
+        if (entry->name == nullptr || (entry->hash == hash && streq(entry->name, macro_name))) {
+            return entry;
+        }
+    }
+}
+
+static void macro_table_grow(MacroTable* table) {
+    MacroTableEntry* old_slots = table->slots;
+    size_t old_capacity = table->capacity;
+
+    table->capacity = old_capacity == 0 ? 256 : old_capacity * 2;
+    table->slots = ARENA_ALLOC(MacroTableEntry, table->capacity);
+
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old_slots[i].name != nullptr) {
+            *macro_table_slot(table, old_slots[i].name, old_slots[i].hash) = old_slots[i];
+        }
     }
 }
 
 static MacroDefinition* is_defined(char* macro_name) {
-    for (size_t i = 0; i < g_expander_context.macro_definitions.count; ++i) {
-        if (streq(g_expander_context.macro_definitions.data[i]->name, macro_name)) {
-            return g_expander_context.macro_definitions.data[i];
+    MacroTable* table = &g_expander_context.macro_definitions;
+    u64 hash = hash_string(macro_name);
+
+    if (table->count > 0) {
+        MacroTableEntry* entry = macro_table_slot(table, macro_name, hash);
+
+        if (entry->name != nullptr) {
+            return entry->definition;
         }
     }
 
-    return nullptr;
+    return predefined_macro_lookup(macro_name, hash);
+}
+
+// definition nullptr undefines macro_name
+static void macro_table_set(char* macro_name, MacroDefinition* definition) {
+    MacroTable* table = &g_expander_context.macro_definitions;
+    if (2 * (table->count + 1) > table->capacity) {
+        macro_table_grow(table);
+    }
+
+    u64 hash = hash_string(macro_name);
+    MacroTableEntry* entry = macro_table_slot(table, macro_name, hash);
+
+    if (entry->name == nullptr) {
+        entry->name = macro_name;
+        entry->hash = hash;
+        table->count++;
+    }
+
+    entry->definition = definition;
+    g_expander_context.generation++;
 }
 
 static PPToken* stream_peekahead(PPTokenStream* stream, ssize_t offset) {
     static PPToken EOF_SENTINEL = {
         .kind = PP_EOF,
         .length = 0,
-        .origin = nullptr,
         .spelling = nullptr,
     };
 
     ssize_t target_index = (ssize_t)stream->current_index + offset;
 
+    // lex as many more lines as the lookahead needs
+    while (target_index >= (ssize_t)stream->pptokens->count &&
+           stream->lexer != nullptr &&
+           lexer_lex_line(stream->lexer, stream->pptokens));
+
     if (target_index >= (ssize_t)stream->pptokens->count || target_index < 0) {
         return &EOF_SENTINEL;
     }
@@ -106,6 +352,13 @@ static void stream_consume(PPTokenStream* stream, size_t count) {
     else {
         stream->current_index += count;
     }
+
+    // Lines are lexed whole, so running out of tokens means we are
+    // at the start of a line and the buffer can be reused for the next.
+    if (stream->lexer != nullptr && stream->current_index == stream->pptokens->count) {
+        stream->pptokens->count = 0;
+        stream->current_index = 0;
+    }
 }
 
 static bool stream_is_it_start_of_line(PPTokenStream* stream) {
@@ -141,6 +394,18 @@ static void stream_skip_line(PPTokenStream* stream) {
     }
 }
 
+/*
+In a group that is being skipped, jumps over whole lines
+straight in the raw bytes, without lexing them, up to the
+next conditional directive. Lines already lexed are left
+for the caller to skip one by one.
+*/
+static void stream_skip_group(PPTokenStream* stream) {
+    if (stream->lexer != nullptr && stream->pptokens->count == 0) {
+        lexer_skip_group(stream->lexer);
+    }
+}
+
 static void stream_skip_whitespace(PPTokenStream* stream) {
     while (true) {
         PPTokenKind kind = stream_peekahead(stream, 0)->kind;
@@ -156,12 +421,12 @@ static void stream_skip_whitespace(PPTokenStream* stream) {
     }
 }
 
-static char* strip_delims(PPToken* header_name) {
-    size_t new_len = header_name->length - 2;
+static char* strip_delims(char* header_name) {
+    size_t new_len = strlen(header_name) - 2;
     char* buffer = ARENA_ALLOC(char, new_len + 1);
 
     for (size_t i = 0; i < new_len; ++i) {
-        buffer[i] = header_name->spelling[i + 1];
+        buffer[i] = header_name[i + 1];
     }
 
     buffer[new_len] = '\0';
@@ -197,17 +462,22 @@ static char* full_path_to_dir(char* full_path) {
     return buf;
 }
 
-static char* get_header_full_path(PPToken* header_name) {
+/*
+Resolves a header name spelled with its delimiters, `site` is
+where it was written, quoted names are relative to that file.
+*/
+static char* get_header_full_path(char* header_name, PPToken* site) {
     char* header_relative_path = strip_delims(header_name);
     char* header_full_path = nullptr;
 
-    if (header_name->spelling[0] == '<') {
+    if (header_name[0] == '<') {
         // it is a library header.
         header_full_path = strcat(g_expander_context.LIB_DIR, header_relative_path);
     }
 
     else {
-        char* this_file_full_path = header_name->origin->data[0]->source_char->origin->data[0]->origin->definition->full_path;
+        Byte* site_byte = pptoken_first_byte(site);
+        char* this_file_full_path = file_inclusion_resolve(site_byte->origin)->definition->full_path;
         char* this_file_dir = full_path_to_dir(this_file_full_path);
         header_full_path = strcat(this_file_dir, header_relative_path);
     }
@@ -215,11 +485,17 @@ static char* get_header_full_path(PPToken* header_name) {
     return header_full_path;
 }
 
-static ExpandedTokenVector* expand_include(PPTokenStream* stream) {
-    if (g_expander_context.current_include_depth >= g_expander_context.MAX_INCLUDE_DEPTH) {
+/*
+Opens the header and pushes its tokens on top of the includer's,
+the expander carries on in the includer once they run out.
+*/
+static void expand_include(Expander* ex) {
+    if (ex->includes.count > g_expander_context.MAX_INCLUDE_DEPTH) {
         panic("max include depth reached");
     }
 
+    PPTokenStream* stream = &ex->includes.data[ex->includes.count - 1];
+
     // We are pointing at the "include" identiifer
     stream_consume(stream, 1);
     stream_skip_whitespace(stream);
@@ -230,22 +506,18 @@ static ExpandedTokenVector* expand_include(PPTokenStream* stream) {
         panic("expected header name after `#include`");
     }
 
-    char* header_full_path = get_header_full_path(header_name);
-
-    g_expander_context.current_include_depth++;
+    char* header_full_path = get_header_full_path(header_name->spelling, header_name);
 
-    ByteVector* bytes = read(header_full_path, header_name);
-    SourceCharVector* source_chars = normalize(bytes);
-    SplicedCharVector* spliced_chars = splice(source_chars);
-    PPTokenVector* pptokens = tokenize(spliced_chars);
-    ExpandedTokenVector* expanded_tokens = expand(pptokens);
-
-    g_expander_context.current_include_depth--;
-
-    // clean up
+    // clean up, before the push moves the stream
     stream_skip_line(stream);
 
-    return expanded_tokens;
+    PPTokenStream header_stream = {
+        .pptokens = ARENA_ALLOC(PPTokenVector, 1),
+        .current_index = 0,
+        .lexer = lexer_create(header_full_path, header_name),
+    };
+
+    vector_push(&ex->includes, header_stream);
 }
 
 PPTokenVector* gather_macro_replacement_tokens(PPTokenStream* stream) {
@@ -332,553 +604,3357 @@ static void record_params(MacroDefinition* def, PPTokenStream* stream) {
     def->params = params;
 }
 
-static void record_function_like_macro(PPTokenStream* stream) {
-    MacroDefinition* def = ARENA_ALLOC(MacroDefinition, 1);
+static ssize_t params_contains(PPTokenVector* params, PPToken* param) {
+    for (ssize_t i = 0; i < (ssize_t)params->count; ++i) {
+        if (pptoken_is(params->data[i], PP_IDENTIFIER, param->spelling)) {
+            return i;
+        }
+    }
 
-    def->name = stream_peekahead(stream, 0)->spelling;
-    stream_consume(stream, 1);
+    return -1;
+}
 
-    def->is_function_like = true;
-    record_params(def, stream);
+/*
+Resolves every parameter reference, __VA_ARGS__, __VA_OPT__, `#`
+and `##` in the replacement list once, so that replace_params()
+can substitute in O(body) without comparing any strings.
+*/
+static MacroOpVector* compile_replacement_list(MacroDefinition* def) {
+    MacroOpVector* body = ARENA_ALLOC(MacroOpVector, 1);
 
-    stream_skip_whitespace(stream);
-    def->replacement_list = gather_macro_replacement_tokens(stream);
+    PPTokenStream stream = {
+        .pptokens = def->replacement_list,
+        .current_index = 0,
+        .lexer = nullptr,
+    };
 
-    vector_push(&g_expander_context.macro_definitions, def);
-    stream_skip_line(stream);
-}
+    // index of the open MACRO_OP_VA_OPT_BEGIN, if any
+    ssize_t va_opt_begin = -1;
+    size_t va_opt_paren_depth = 0;
 
-static void record_object_like_macro(PPTokenStream* stream) {
-    MacroDefinition* def = ARENA_ALLOC(MacroDefinition, 1);
+    // set by a `#` in front of the next __VA_OPT__
+    bool is_va_opt_stringized = false;
 
-    def->name = stream_peekahead(stream, 0)->spelling;
+    while (true) {
+        PPToken* token = stream_peekahead(&stream, 0);
 
-    stream_consume(stream, 1);
-    stream_skip_whitespace(stream);
+        if (token->kind == PP_EOF) {
+            break;
+        }
 
-    def->replacement_list = gather_macro_replacement_tokens(stream);
+        stream_consume(&stream, 1);
 
-    vector_push(&g_expander_context.macro_definitions, def);
-    stream_skip_line(stream);
-}
+        MacroOp op = {
+            .kind = MACRO_OP_LITERAL,
+            .operand = 0,
+            .token = token,
+        };
 
-static void record_define(PPTokenStream* stream) {
-    stream_consume(stream, 1);
-    stream_skip_whitespace(stream);
+        if (va_opt_begin != -1 && pptoken_is(token, PP_PUNCTUATOR, "(")) {
+            va_opt_paren_depth++;
+        }
 
-    PPToken* macro_name_token = stream_peekahead(stream, 0);
-    if (macro_name_token->kind != PP_IDENTIFIER) {
-        panic("expected macro name after `#define`");
-    }
+        else if (va_opt_begin != -1 && pptoken_is(token, PP_PUNCTUATOR, ")")) {
+            if (va_opt_paren_depth == 0) {
+                op.kind = MACRO_OP_VA_OPT_END;
+                op.operand = is_va_opt_stringized;
+                body->data[va_opt_begin].operand = body->count;
+                va_opt_begin = -1;
+                is_va_opt_stringized = false;
+            }
 
-    char* macro_name = macro_name_token->spelling;
-    if (is_defined(macro_name)) {
-        panic("redefinition of macro");
-    }
+            else {
+                va_opt_paren_depth--;
+            }
+        }
 
-    if (pptoken_is(stream_peekahead(stream, 1), PP_PUNCTUATOR, "(")) {
-        record_function_like_macro(stream);
-    }
+        else if (pptoken_is(token, PP_PUNCTUATOR, "##") || pptoken_is(token, PP_PUNCTUATOR, "%:%:")) {
+            // whitespace around `##` belongs to neither operand
+            while (body->count > 0 &&
+                   body->data[body->count - 1].kind == MACRO_OP_LITERAL &&
+                   body->data[body->count - 1].token->kind == PP_WHITESPACE) {
+                body->count--;
+            }
 
-    else {
-        record_object_like_macro(stream);
-    }
-}
+            // nor does whitespace at the end of a __VA_OPT__ group that is the left operand
+            if (body->count > 0 && body->data[body->count - 1].kind == MACRO_OP_VA_OPT_END) {
+                MacroOp end = body->data[--body->count];
 
-static void record_ifndef(PPTokenStream* stream) {
-    stream_consume(stream, 1);
-    stream_skip_whitespace(stream);
+                while (body->data[body->count - 1].kind == MACRO_OP_LITERAL &&
+                       body->data[body->count - 1].token->kind == PP_WHITESPACE) {
+                    body->count--;
+                }
 
-    ConditionalState parent_state = conditional_stack_top(&g_expander_context.conditional_stack);
+                // the group ends earlier now, its begin has to point at the new end
+                for (size_t i = body->count; i-- > 0;) {
+                    if (body->data[i].kind == MACRO_OP_VA_OPT_BEGIN) {
+                        body->data[i].operand = body->count;
+                        break;
+                    }
+                }
 
-    ConditionalState my_state = COND_ACTIVE;
-    if (parent_state == COND_SKIPPING) {
-        my_state = COND_SKIPPING;
-    }
+                vector_push(body, end);
+            }
 
-    else if (parent_state == COND_ACTIVE) {
-        PPToken* macro_name = stream_peekahead(stream, 0);
+            stream_skip_whitespace(&stream);
 
-        if (macro_name->kind != PP_IDENTIFIER) {
-            panic("expected macro name after `#ifndef`");
-        }
+            if (body->count == 0 || stream_peekahead(&stream, 0)->kind == PP_EOF) {
+                panic_pptoken(token, "`##` cannot appear at either end of a macro replacement list");
+            }
 
-        if (is_defined(macro_name->spelling)) {
-            my_state = COND_SKIPPING;
+            op.kind = MACRO_OP_PASTE;
         }
 
-        else {
-            my_state = COND_ACTIVE;
+        else if (def->is_function_like &&
+                 (pptoken_is(token, PP_PUNCTUATOR, "#") || pptoken_is(token, PP_PUNCTUATOR, "%:"))) {
+            stream_skip_whitespace(&stream);
+            PPToken* param = stream_peekahead(&stream, 0);
+
+            // C23 6.10.5.2: `# __VA_OPT__(...)` spells what the group gives
+            if (def->is_variadic && pptoken_is(param, PP_IDENTIFIER, "__VA_OPT__")) {
+                is_va_opt_stringized = true;
+                continue;
+            }
+
+            ssize_t param_index = -1;
+            if (def->is_variadic && pptoken_is(param, PP_IDENTIFIER, "__VA_ARGS__")) {
+                // the variable arguments come after the named ones
+                param_index = def->params->count;
+            }
+
+            else if (param->kind == PP_IDENTIFIER) {
+                param_index = params_contains(def->params, param);
+            }
+
+            if (param_index == -1) {
+                panic_pptoken(token, "`#` is not followed by a macro parameter");
+            }
+
+            stream_consume(&stream, 1);
+
+            op.kind = MACRO_OP_STRINGIZE;
+            op.operand = param_index;
         }
-    }
 
-    conditional_stack_push(&g_expander_context.conditional_stack, my_state);
+        else if (pptoken_is(token, PP_IDENTIFIER, "__VA_ARGS__")) {
+            if (!def->is_variadic) {
+                panic("__VA_ARGS__ inside nonvariadic macro");
+            }
 
-    // clean up
-    stream_skip_line(stream);
-}
+            op.kind = MACRO_OP_VA_ARGS;
+        }
 
-static void record_endif(PPTokenStream* stream) {
-    if (g_expander_context.conditional_stack.count == 0) {
-        panic("stray `#endif`");
-    }
+        else if (pptoken_is(token, PP_IDENTIFIER, "__VA_OPT__")) {
+            if (!def->is_variadic) {
+                panic("__VA_OPT__ inside nonvariadic macro");
+            }
 
-    conditional_stack_pop(&g_expander_context.conditional_stack);
+            if (va_opt_begin != -1) {
+                panic("nested __VA_OPT__");
+            }
 
-    // clean up
-    stream_skip_line(stream);
-}
+            stream_skip_whitespace(&stream);
 
-static ExpandedTokenVector* execute_directive(PPTokenStream* stream) {
-    stream_consume(stream, 1);
-    stream_skip_whitespace(stream);
+            if (!pptoken_is(stream_peekahead(&stream, 0), PP_PUNCTUATOR, "(")) {
+                panic("expected `(`");
+            }
 
-    ConditionalState current_conditional_state = conditional_stack_top(&g_expander_context.conditional_stack);
-    PPToken* directive_name_token = stream_peekahead(stream, 0);
+            stream_consume(&stream, 1);
 
-    // These directives are only checked if we are not skipping
-    if (current_conditional_state != COND_SKIPPING) {
-        if (pptoken_is(directive_name_token, PP_IDENTIFIER, "include")) {
-            return expand_include(stream);
+            // whitespace at the start of a group that is the right operand of `##` goes too
+            if (body->count > 0 && body->data[body->count - 1].kind == MACRO_OP_PASTE) {
+                stream_skip_whitespace(&stream);
+            }
+
+            op.kind = MACRO_OP_VA_OPT_BEGIN;
+            va_opt_begin = body->count;
+            va_opt_paren_depth = 0;
         }
 
-        // else if (#embed, #undef)
-        else if (pptoken_is(directive_name_token, PP_IDENTIFIER, "define")) {
-            record_define(stream);
-            return ARENA_ALLOC(ExpandedTokenVector, 1);
+        else if (def->is_function_like && token->kind == PP_IDENTIFIER) {
+            ssize_t param_index = params_contains(def->params, token);
+
+            if (param_index != -1) {
+                op.kind = MACRO_OP_PARAM;
+                op.operand = param_index;
+            }
         }
-    }
 
-    if (pptoken_is(directive_name_token, PP_IDENTIFIER, "ifndef")) {
-        record_ifndef(stream);
-        return ARENA_ALLOC(ExpandedTokenVector, 1);
+        vector_push(body, op);
     }
 
-    else if (pptoken_is(directive_name_token, PP_IDENTIFIER, "endif")) {
-        record_endif(stream);
-        return ARENA_ALLOC(ExpandedTokenVector, 1);
+    if (va_opt_begin != -1) {
+        panic("expected `)`");
     }
 
-    // else if (#elifndef, #else ...)
+    return body;
+}
 
-    else {
-        // null directive or nondirective. Just forget this line.
-        stream_skip_line(stream);
-        return ARENA_ALLOC(ExpandedTokenVector, 1);
-    }
+static MacroDefinition* record_function_like_macro(PPTokenStream* stream) {
+    MacroDefinition* def = ARENA_ALLOC(MacroDefinition, 1);
+
+    def->name = stream_peekahead(stream, 0)->spelling;
+    stream_consume(stream, 1);
+
+    def->is_function_like = true;
+    record_params(def, stream);
+
+    stream_skip_whitespace(stream);
+    def->replacement_list = gather_macro_replacement_tokens(stream);
+    def->body = compile_replacement_list(def);
+
+    return def;
 }
 
-static void stream_skip_whitespace_and_newline(PPTokenStream* stream) {
-    while (true) {
-        PPTokenKind kind = stream_peekahead(stream, 0)->kind;
+static MacroDefinition* record_object_like_macro(PPTokenStream* stream) {
+    MacroDefinition* def = ARENA_ALLOC(MacroDefinition, 1);
 
-        if (kind == PP_WHITESPACE || kind == PP_NEWLINE) {
-            stream_consume(stream, 1);
-            continue;
-        }
+    def->name = stream_peekahead(stream, 0)->spelling;
 
-        else {
-            return;
-        }
-    }
+    stream_consume(stream, 1);
+    stream_skip_whitespace(stream);
+
+    def->replacement_list = gather_macro_replacement_tokens(stream);
+    def->body = compile_replacement_list(def);
+
+    return def;
 }
 
-static PPTokenVector* record_arg(PPTokenStream* stream) {
-    PPTokenVector* arg = ARENA_ALLOC(PPTokenVector, 1);
+static u64 fingerprint_mix(u64 hash, u64 value) {
+    return (hash ^ value) * 0x100000001b3;
+}
 
-    size_t paren_depth = 0;
-    while (true) {
-        PPToken* token = stream_peekahead(stream, 0);
+/*
+C23 6.10.4.2: a redefinition must have the same parameters and a
+replacement list with the same tokens, where any whitespace
+between two tokens counts the same and none at either end counts
+at all. The fingerprint hashes exactly that.
+*/
+static u64 macro_fingerprint(MacroDefinition* def) {
+    u64 hash = fingerprint_mix(0xcbf29ce484222325, def->is_function_like);
+    hash = fingerprint_mix(hash, def->is_variadic);
 
-        if (token->kind == PP_EOF) {
-            panic("expected `)`");
-        }
+    if (def->is_function_like) {
+        hash = fingerprint_mix(hash, def->params->count);
 
-        if (pptoken_is(token, PP_PUNCTUATOR, ")") && paren_depth == 0) {
-            break;
+        for (size_t i = 0; i < def->params->count; ++i) {
+            hash = fingerprint_mix(hash, hash_string(def->params->data[i]->spelling));
         }
+    }
 
-        if (pptoken_is(token, PP_PUNCTUATOR, ",") && paren_depth == 0) {
-            break;
-        }
+    bool is_separated = false;
+    bool is_first = true;
 
-        if (pptoken_is(token, PP_PUNCTUATOR, ")") && paren_depth > 0) {
-            paren_depth--;
-            vector_push(arg, token);
-            stream_consume(stream, 1);
+    for (size_t i = 0; i < def->replacement_list->count; ++i) {
+        PPToken* token = def->replacement_list->data[i];
+
+        if (token->kind == PP_WHITESPACE) {
+            is_separated = true;
             continue;
         }
 
-        if (pptoken_is(token, PP_PUNCTUATOR, "(")) {
-            paren_depth++;
-            vector_push(arg, token);
-            stream_consume(stream, 1);
-            continue;
+        if (is_separated && !is_first) {
+            hash = fingerprint_mix(hash, PP_WHITESPACE);
         }
 
-        vector_push(arg, token);
-        stream_consume(stream, 1);
-        continue;
+        hash = fingerprint_mix(hash, token->kind);
+        hash = fingerprint_mix(hash, hash_string(token->spelling));
+
+        is_separated = false;
+        is_first = false;
     }
 
-    return arg;
+    return hash;
 }
 
-static PPTokenVector* record_va_args(PPTokenStream* stream) {
-    PPTokenVector* va_args = ARENA_ALLOC(PPTokenVector, 1);
+/*
+Index of the first token from i on that is not whitespace, with
+is_separated telling whether any whitespace was skipped to get there.
+*/
+static size_t next_replacement_token(PPTokenVector* tokens, size_t i, bool* is_separated) {
+    *is_separated = false;
 
-    size_t paren_depth = 0;
-    while (true) {
-        PPToken* token = stream_peekahead(stream, 0);
+    while (i < tokens->count && tokens->data[i]->kind == PP_WHITESPACE) {
+        *is_separated = true;
+        i++;
+    }
 
-        if (token->kind == PP_EOF) {
-            panic("expected `)`");
-        }
+    return i;
+}
 
-        else if (pptoken_is(token, PP_PUNCTUATOR, ")") && paren_depth == 0) {
-            break;
+// the full comparison behind macro_fingerprint, for when two fingerprints match
+static bool macro_definitions_equal(MacroDefinition* a, MacroDefinition* b) {
+    if (a->is_function_like != b->is_function_like || a->is_variadic != b->is_variadic) {
+        return false;
+    }
+
+    if (a->is_function_like) {
+        if (a->params->count != b->params->count) {
+            return false;
         }
 
-        else if (pptoken_is(token, PP_PUNCTUATOR, ")") && paren_depth > 0) {
+        for (size_t i = 0; i < a->params->count; ++i) {
+            if (!streq(a->params->data[i]->spelling, b->params->data[i]->spelling)) {
+                return false;
+            }
+        }
+    }
+
+    bool a_separated = false;
+    bool b_separated = false;
+    size_t i = next_replacement_token(a->replacement_list, 0, &a_separated);
+    size_t j = next_replacement_token(b->replacement_list, 0, &b_separated);
+    bool is_first = true;
+
+    while (i < a->replacement_list->count && j < b->replacement_list->count) {
+        PPToken* token_a = a->replacement_list->data[i];
+        PPToken* token_b = b->replacement_list->data[j];
+
+        if (!is_first && a_separated != b_separated) {
+            return false;
+        }
+
+        if (token_a->kind != token_b->kind || !streq(token_a->spelling, token_b->spelling)) {
+            return false;
+        }
+
+        i = next_replacement_token(a->replacement_list, i + 1, &a_separated);
+        j = next_replacement_token(b->replacement_list, j + 1, &b_separated);
+        is_first = false;
+    }
+
+    return i == a->replacement_list->count && j == b->replacement_list->count;
+}
+
+static void record_define(PPTokenStream* stream) {
+    stream_consume(stream, 1);
+    stream_skip_whitespace(stream);
+
+    PPToken* macro_name_token = stream_peekahead(stream, 0);
+    if (macro_name_token->kind != PP_IDENTIFIER) {
+        panic("expected macro name after `#define`");
+    }
+
+    MacroDefinition* def = nullptr;
+    if (pptoken_is(stream_peekahead(stream, 1), PP_PUNCTUATOR, "(")) {
+        def = record_function_like_macro(stream);
+    }
+
+    else {
+        def = record_object_like_macro(stream);
+    }
+
+    stream_skip_line(stream);
+    def->fingerprint = macro_fingerprint(def);
+
+    // An identical redefinition changes nothing, the first one stays.
+    // Differing fingerprints rule it out at once, matching ones are checked in full.
+    MacroDefinition* previous = is_defined(def->name);
+    if (previous != nullptr) {
+        if (previous->fingerprint != def->fingerprint || !macro_definitions_equal(previous, def)) {
+            panic_pptoken(macro_name_token, "incompatible redefinition of macro `%s`", def->name);
+        }
+
+        return;
+    }
+
+    def->id = g_expander_context.macro_definitions.next_id++;
+    macro_table_set(def->name, def);
+}
+
+static void record_undef(PPTokenStream* stream) {
+    stream_consume(stream, 1);
+    stream_skip_whitespace(stream);
+
+    PPToken* macro_name_token = stream_peekahead(stream, 0);
+    if (macro_name_token->kind != PP_IDENTIFIER) {
+        panic("expected macro name after `#undef`");
+    }
+
+    if (is_defined(macro_name_token->spelling) != nullptr) {
+        macro_table_set(macro_name_token->spelling, nullptr);
+    }
+
+    stream_skip_line(stream);
+}
+
+static bool is_defined_for_condition(char* macro_name) {
+    // __has_include counts as defined, so that it can be tested for
+    return is_defined(macro_name) != nullptr || streq(macro_name, "__has_include");
+}
+
+static bool header_exists(char* full_path) {
+    s32 fd = linux_open(full_path, LINUX_FILE_FLAG_READONLY, 0);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    linux_close(fd);
+    return true;
+}
+
+/*
+The controlling expression of an #if or #elif is compiled once
+into a small stack bytecode and cached by where the directive is
+in its file, so a header entered many times parses each of its
+conditions once. Identifiers stay symbolic in the bytecode and are
+looked up when it runs, so it stays valid across #define and #undef.
+*/
+typedef enum IfOpKind {
+    IF_OP_PUSH,         // push `value`
+    IF_OP_IDENTIFIER,   // push the value of the macro `name`, 0 if there is none
+    IF_OP_DEFINED,      // push whether the macro `name` is defined
+    IF_OP_HAS_INCLUDE,  // push whether the header `name` can be found
+
+    IF_OP_NEGATE,
+    IF_OP_COMPLEMENT,
+    IF_OP_NOT,
+
+    IF_OP_MULTIPLY,
+    IF_OP_DIVIDE,
+    IF_OP_REMAINDER,
+    IF_OP_ADD,
+    IF_OP_SUBTRACT,
+    IF_OP_SHIFT_LEFT,
+    IF_OP_SHIFT_RIGHT,
+    IF_OP_LESS,
+    IF_OP_GREATER,
+    IF_OP_LESS_EQUAL,
+    IF_OP_GREATER_EQUAL,
+    IF_OP_EQUAL,
+    IF_OP_NOT_EQUAL,
+    IF_OP_BIT_AND,
+    IF_OP_BIT_XOR,
+    IF_OP_BIT_OR,
+
+    IF_OP_TO_BOOL,        // replace the top with 0 or 1
+    IF_OP_AND_THEN,       // if the top is 0 keep it and jump to `target`, else pop it
+    IF_OP_OR_ELSE,        // if the top is not 0 make it 1 and jump to `target`, else pop it
+    IF_OP_JUMP_IF_FALSE,  // pop, and jump to `target` if it was 0
+    IF_OP_JUMP,
+} IfOpKind;
+
+// intmax_t or uintmax_t, C23 6.10.2
+typedef struct IfValue {
+    u64 value;
+    bool is_unsigned;
+} IfValue;
+
+typedef struct IfOp {
+    IfOpKind kind;
+    IfValue value;
+    size_t target;
+    char* name;
+
+    // the token this op was compiled from, for diagnostics
+    PPToken* token;
+} IfOp;
+
+typedef struct IfOpVector {
+    IfOp* data;
+    size_t count;
+    size_t capacity;
+} IfOpVector;
+
+typedef struct IfExpression {
+    IfOpVector ops;
+
+    // The line only makes sense after macro expansion,
+    // it calls a function-like macro for instance.
+    bool needs_expansion;
+} IfExpression;
+
+typedef struct IfExpressionEntry {
+    FileDefinition* file;
+    size_t offset;
+    IfExpression* expression;
+
+    struct IfExpressionEntry* next_in_bucket;
+} IfExpressionEntry;
+
+typedef struct IfExpressionCache {
+    IfExpressionEntry** buckets;
+    size_t bucket_count;
+    size_t count;
+} IfExpressionCache;
+
+typedef struct IfValueStack {
+    IfValue* data;
+    size_t count;
+    size_t capacity;
+} IfValueStack;
+
+static IfExpressionCache g_if_expressions = {0};
+static IfValueStack g_if_stack = {0};
+
+typedef struct IfCompiler {
+    PPTokenVector* tokens;
+    size_t current_index;
+
+    IfExpression* expression;
+    bool is_expanded;  // identifiers left after expansion are plain 0s
+
+    // the first error, nullptr while there is none
+    char* error;
+    PPToken* error_token;
+} IfCompiler;
+
+static IfValue if_value(u64 value, bool is_unsigned) {
+    IfValue result = {
+        .value = value,
+        .is_unsigned = is_unsigned,
+    };
+
+    return result;
+}
+
+static IfValue if_bool(bool value) {
+    return if_value(value ? 1 : 0, false);
+}
+
+static bool parse_integer_constant(char* spelling, IfValue* value) {
+    char* p = spelling;
+    u64 base = 10;
+
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    }
+
+    else if (p[0] == '0' && (p[1] == 'b' || p[1] == 'B')) {
+        base = 2;
+        p += 2;
+    }
+
+    else if (p[0] == '0') {
+        base = 8;
+    }
+
+    u64 result = 0;
+    bool has_digits = false;
+    for (; *p != '\0'; ++p) {
+        u64 digit = 0;
+
+        if (*p == '\'') {
+            continue;
+        }
+
+        else if (*p >= '0' && *p <= '9') {
+            digit = *p - '0';
+        }
+
+        else if (base == 16 && *p >= 'a' && *p <= 'f') {
+            digit = *p - 'a' + 10;
+        }
+
+        else if (base == 16 && *p >= 'A' && *p <= 'F') {
+            digit = *p - 'A' + 10;
+        }
+
+        else {
+            break;
+        }
+
+        if (digit >= base || result > (~0ULL - digit) / base) {
+            return false;
+        }
+
+        result = result * base + digit;
+        has_digits = true;
+    }
+
+    if (!has_digits) {
+        return false;
+    }
+
+    bool has_u = false;
+    size_t l_count = 0;
+    for (; *p != '\0'; ++p) {
+        if ((*p == 'u' || *p == 'U') && !has_u) {
+            has_u = true;
+        }
+
+        else if ((*p == 'l' || *p == 'L') && l_count < 2) {
+            l_count++;
+        }
+
+        else if ((p[0] == 'w' && p[1] == 'b') || (p[0] == 'W' && p[1] == 'B')) {
+            p++;
+        }
+
+        else {
+            return false;
+        }
+    }
+
+    // too large for intmax_t is only representable as uintmax_t
+    *value = if_value(result, has_u || result > 0x7fffffffffffffffULL);
+    return true;
+}
+
+static u32 hex_digit_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return c - 'A' + 10;
+}
+
+static bool parse_character_constant(char* spelling, IfValue* value) {
+    char* p = spelling;
+    bool has_prefix = *p != '\'';
+
+    while (*p != '\'') {
+        p++;
+    }
+    p++;
+
+    u64 result = 0;
+    size_t char_count = 0;
+    while (*p != '\'' && *p != '\0') {
+        u32 c = 0;
+
+        if (*p != '\\') {
+            c = decode_UTF8(&p);
+        }
+
+        else {
+            p++;
+
+            switch (*p) {
+                case 'n': c = '\n'; p++; break;
+                case 't': c = '\t'; p++; break;
+                case 'r': c = '\r'; p++; break;
+                case 'a': c = '\a'; p++; break;
+                case 'b': c = '\b'; p++; break;
+                case 'f': c = '\f'; p++; break;
+                case 'v': c = '\v'; p++; break;
+
+                case 'x':
+                    for (p++; is_hex_digit(*p); p++) {
+                        c = (c << 4) | hex_digit_value(*p);
+                    }
+                    break;
+
+                case 'u':
+                case 'U': {
+                    size_t digit_count = *p == 'u' ? 4 : 8;
+                    p++;
+
+                    for (size_t i = 0; i < digit_count && is_hex_digit(*p); ++i, ++p) {
+                        c = (c << 4) | hex_digit_value(*p);
+                    }
+                    break;
+                }
+
+                default:
+                    if (*p >= '0' && *p <= '7') {
+                        for (size_t i = 0; i < 3 && *p >= '0' && *p <= '7'; ++i, ++p) {
+                            c = (c << 3) | (*p - '0');
+                        }
+                    }
+
+                    // \\ \' \" \?
+                    else {
+                        c = *p++;
+                    }
+                    break;
+            }
+        }
+
+        result = (result << 8) | c;
+        char_count++;
+    }
+
+    if (*p != '\'' || char_count == 0) {
+        return false;
+    }
+
+    // a plain char is signed, like in the compiler proper
+    if (!has_prefix && char_count == 1 && result < 0x100) {
+        result = (u64)(s64)(signed char)result;
+    }
+
+    *value = if_value(result, false);
+    return true;
+}
+
+static void if_compiler_fail(IfCompiler* c, PPToken* token, char* error) {
+    if (c->error == nullptr) {
+        c->error = error;
+        c->error_token = token;
+    }
+}
+
+// the next token that is not whitespace, nullptr at the end of the line
+static PPToken* if_compiler_peek(IfCompiler* c) {
+    while (c->current_index < c->tokens->count &&
+           c->tokens->data[c->current_index]->kind == PP_WHITESPACE) {
+        c->current_index++;
+    }
+
+    if (c->current_index == c->tokens->count) {
+        return nullptr;
+    }
+
+    return c->tokens->data[c->current_index];
+}
+
+static bool if_compiler_accept(IfCompiler* c, char* punctuator) {
+    PPToken* token = if_compiler_peek(c);
+
+    if (token != nullptr && pptoken_is(token, PP_PUNCTUATOR, punctuator)) {
+        c->current_index++;
+        return true;
+    }
+
+    return false;
+}
+
+static size_t if_compiler_emit(IfCompiler* c, IfOpKind kind, PPToken* token) {
+    IfOp op = {
+        .kind = kind,
+        .value = if_bool(false),
+        .target = 0,
+        .name = nullptr,
+        .token = token,
+    };
+
+    vector_push(&c->expression->ops, op);
+    return c->expression->ops.count - 1;
+}
+
+// `defined X` or `defined ( X )`, the `defined` is already consumed
+static PPToken* if_parse_defined_operand(IfCompiler* c) {
+    bool has_paren = if_compiler_accept(c, "(");
+
+    PPToken* macro_name = if_compiler_peek(c);
+    if (macro_name == nullptr || macro_name->kind != PP_IDENTIFIER) {
+        if_compiler_fail(c, macro_name, "expected macro name after `defined`");
+        return nullptr;
+    }
+
+    c->current_index++;
+
+    if (has_paren && !if_compiler_accept(c, ")")) {
+        if_compiler_fail(c, if_compiler_peek(c), "expected `)`");
+        return nullptr;
+    }
+
+    return macro_name;
+}
+
+/*
+`__has_include ( header-name )`, the `__has_include` is already
+consumed. Returns the header name spelled with its delimiters.
+*/
+static char* if_parse_has_include_operand(IfCompiler* c) {
+    if (!if_compiler_accept(c, "(")) {
+        if_compiler_fail(c, if_compiler_peek(c), "expected `(` after `__has_include`");
+        return nullptr;
+    }
+
+    PPToken* token = if_compiler_peek(c);
+    char* header_name = nullptr;
+
+    if (token != nullptr &&
+        (token->kind == PP_HEADERNAME || (token->kind == PP_STRING && token->spelling[0] == '\"'))) {
+        c->current_index++;
+        header_name = token->spelling;
+    }
+
+    // outside of #include, <...> is lexed as separate tokens
+    else if (token != nullptr && pptoken_is(token, PP_PUNCTUATOR, "<")) {
+        c->current_index++;
+        header_name = "<";
+
+        while (true) {
+            if (c->current_index == c->tokens->count) {
+                if_compiler_fail(c, token, "expected `>`");
+                return nullptr;
+            }
+
+            PPToken* part = c->tokens->data[c->current_index++];
+            header_name = strcat(header_name, part->spelling);
+
+            if (pptoken_is(part, PP_PUNCTUATOR, ">")) {
+                break;
+            }
+        }
+    }
+
+    else {
+        if_compiler_fail(c, token, "expected header name");
+        return nullptr;
+    }
+
+    if (!if_compiler_accept(c, ")")) {
+        if_compiler_fail(c, if_compiler_peek(c), "expected `)`");
+        return nullptr;
+    }
+
+    return header_name;
+}
+
+static void if_compile_conditional(IfCompiler* c);
+
+static void if_compile_primary(IfCompiler* c) {
+    PPToken* token = if_compiler_peek(c);
+
+    if (token == nullptr) {
+        if_compiler_fail(c, nullptr, "expected expression");
+        return;
+    }
+
+    c->current_index++;
+
+    if (pptoken_is(token, PP_PUNCTUATOR, "(")) {
+        if_compile_conditional(c);
+
+        if (!if_compiler_accept(c, ")")) {
+            if_compiler_fail(c, if_compiler_peek(c), "expected `)`");
+        }
+    }
+
+    else if (token->kind == PP_NUMBER || token->kind == PP_CHAR) {
+        size_t index = if_compiler_emit(c, IF_OP_PUSH, token);
+
+        bool is_valid = token->kind == PP_NUMBER
+                            ? parse_integer_constant(token->spelling, &c->expression->ops.data[index].value)
+                            : parse_character_constant(token->spelling, &c->expression->ops.data[index].value);
+
+        if (!is_valid) {
+            if_compiler_fail(c, token, "invalid integer constant");
+        }
+    }
+
+    else if (pptoken_is(token, PP_IDENTIFIER, "defined")) {
+        PPToken* macro_name = if_parse_defined_operand(c);
+
+        if (macro_name != nullptr) {
+            size_t index = if_compiler_emit(c, IF_OP_DEFINED, token);
+            c->expression->ops.data[index].name = macro_name->spelling;
+        }
+    }
+
+    else if (pptoken_is(token, PP_IDENTIFIER, "__has_include")) {
+        char* header_name = if_parse_has_include_operand(c);
+
+        if (header_name != nullptr) {
+            size_t index = if_compiler_emit(c, IF_OP_HAS_INCLUDE, token);
+            c->expression->ops.data[index].name = header_name;
+        }
+    }
+
+    else if (token->kind == PP_IDENTIFIER && c->is_expanded) {
+        size_t index = if_compiler_emit(c, IF_OP_PUSH, token);
+        c->expression->ops.data[index].value = if_bool(streq(token->spelling, "true"));
+    }
+
+    else if (token->kind == PP_IDENTIFIER) {
+        // only expansion can tell what a call turns into
+        PPToken* next = if_compiler_peek(c);
+        if (next != nullptr && pptoken_is(next, PP_PUNCTUATOR, "(")) {
+            if_compiler_fail(c, token, "function-like macro invocation");
+            return;
+        }
+
+        size_t index = if_compiler_emit(c, IF_OP_IDENTIFIER, token);
+        c->expression->ops.data[index].name = token->spelling;
+    }
+
+    else {
+        if_compiler_fail(c, token, "expected expression");
+    }
+}
+
+static void if_compile_unary(IfCompiler* c) {
+    PPToken* token = if_compiler_peek(c);
+
+    if (if_compiler_accept(c, "+")) {
+        if_compile_unary(c);
+    }
+
+    else if (if_compiler_accept(c, "-")) {
+        if_compile_unary(c);
+        if_compiler_emit(c, IF_OP_NEGATE, token);
+    }
+
+    else if (if_compiler_accept(c, "~")) {
+        if_compile_unary(c);
+        if_compiler_emit(c, IF_OP_COMPLEMENT, token);
+    }
+
+    else if (if_compiler_accept(c, "!")) {
+        if_compile_unary(c);
+        if_compiler_emit(c, IF_OP_NOT, token);
+    }
+
+    else {
+        if_compile_primary(c);
+    }
+}
+
+// 0 if token is no binary operator, higher binds tighter
+static size_t if_binary_precedence(PPToken* token, IfOpKind* kind) {
+    static const struct {
+        char* spelling;
+        IfOpKind kind;
+        size_t precedence;
+    } operators[] = {
+        {"||", IF_OP_OR_ELSE, 1},
+        {"&&", IF_OP_AND_THEN, 2},
+        {"|", IF_OP_BIT_OR, 3},
+        {"^", IF_OP_BIT_XOR, 4},
+        {"&", IF_OP_BIT_AND, 5},
+        {"==", IF_OP_EQUAL, 6},
+        {"!=", IF_OP_NOT_EQUAL, 6},
+        {"<", IF_OP_LESS, 7},
+        {">", IF_OP_GREATER, 7},
+        {"<=", IF_OP_LESS_EQUAL, 7},
+        {">=", IF_OP_GREATER_EQUAL, 7},
+        {"<<", IF_OP_SHIFT_LEFT, 8},
+        {">>", IF_OP_SHIFT_RIGHT, 8},
+        {"+", IF_OP_ADD, 9},
+        {"-", IF_OP_SUBTRACT, 9},
+        {"*", IF_OP_MULTIPLY, 10},
+        {"/", IF_OP_DIVIDE, 10},
+        {"%", IF_OP_REMAINDER, 10},
+    };
+
+    if (token == nullptr || token->kind != PP_PUNCTUATOR) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); ++i) {
+        if (streq(token->spelling, operators[i].spelling)) {
+            *kind = operators[i].kind;
+            return operators[i].precedence;
+        }
+    }
+
+    return 0;
+}
+
+static void if_compile_binary(IfCompiler* c, size_t min_precedence) {
+    if_compile_unary(c);
+
+    while (c->error == nullptr) {
+        PPToken* token = if_compiler_peek(c);
+
+        IfOpKind kind = IF_OP_PUSH;
+        size_t precedence = if_binary_precedence(token, &kind);
+        if (precedence == 0 || precedence < min_precedence) {
+            break;
+        }
+
+        c->current_index++;
+
+        // short-circuit, the right operand is not evaluated at all
+        if (kind == IF_OP_AND_THEN || kind == IF_OP_OR_ELSE) {
+            size_t jump = if_compiler_emit(c, kind, token);
+            if_compile_binary(c, precedence + 1);
+            if_compiler_emit(c, IF_OP_TO_BOOL, token);
+            c->expression->ops.data[jump].target = c->expression->ops.count;
+        }
+
+        else {
+            if_compile_binary(c, precedence + 1);
+            if_compiler_emit(c, kind, token);
+        }
+    }
+}
+
+static void if_compile_conditional(IfCompiler* c) {
+    if_compile_binary(c, 1);
+
+    PPToken* token = if_compiler_peek(c);
+    if (c->error != nullptr || !if_compiler_accept(c, "?")) {
+        return;
+    }
+
+    size_t jump_to_else = if_compiler_emit(c, IF_OP_JUMP_IF_FALSE, token);
+    if_compile_conditional(c);
+
+    if (!if_compiler_accept(c, ":")) {
+        if_compiler_fail(c, if_compiler_peek(c), "expected `:`");
+        return;
+    }
+
+    size_t jump_to_end = if_compiler_emit(c, IF_OP_JUMP, token);
+    c->expression->ops.data[jump_to_else].target = c->expression->ops.count;
+
+    if_compile_conditional(c);
+    c->expression->ops.data[jump_to_end].target = c->expression->ops.count;
+}
+
+static void if_compiler_panic(IfCompiler* c, PPToken* directive_name) {
+    PPToken* token = c->error_token != nullptr ? c->error_token : directive_name;
+    panic_pptoken(token, "%s in `#%s`", c->error, directive_name->spelling);
+}
+
+/*
+Compiles the tokens of a condition. Unexpanded tokens that do not
+form an expression on their own are not an error yet, macros may
+still turn them into one, the expression then needs expansion.
+*/
+static IfExpression* if_compile(PPTokenVector* condition, bool is_expanded, PPToken* directive_name) {
+    IfCompiler c = {
+        .tokens = condition,
+        .current_index = 0,
+        .expression = ARENA_ALLOC(IfExpression, 1),
+        .is_expanded = is_expanded,
+        .error = nullptr,
+        .error_token = nullptr,
+    };
+
+    if_compile_conditional(&c);
+
+    if (c.error == nullptr && if_compiler_peek(&c) != nullptr) {
+        if_compiler_fail(&c, if_compiler_peek(&c), "missing binary operator");
+    }
+
+    if (c.error != nullptr) {
+        if (is_expanded) {
+            if_compiler_panic(&c, directive_name);
+        }
+
+        c.expression->needs_expansion = true;
+    }
+
+    return c.expression;
+}
+
+/*
+The value of an identifier that was not expanded in place: 0 unless
+it names an object-like macro whose replacement list is one number,
+or one identifier with such a value in turn. Returns false for any
+other macro, whose value takes real expansion.
+*/
+static bool if_identifier_value(char* name, IfValue* value) {
+    u32 visited[16];
+    size_t visited_count = 0;
+
+    while (true) {
+        MacroDefinition* def = is_defined(name);
+
+        if (def == nullptr) {
+            if (streq(name, "defined") || streq(name, "__has_include")) {
+                return false;
+            }
+
+            *value = if_bool(streq(name, "true"));
+            return true;
+        }
+
+        // a macro met twice refers to itself and stays an identifier
+        for (size_t i = 0; i < visited_count; ++i) {
+            if (visited[i] == def->id) {
+                *value = if_bool(false);
+                return true;
+            }
+        }
+
+        if (def->is_function_like || def->predefined != PREDEFINED_NONE ||
+            visited_count == sizeof(visited) / sizeof(visited[0])) {
+            return false;
+        }
+
+        visited[visited_count++] = def->id;
+
+        PPToken* replacement = nullptr;
+        for (size_t i = 0; i < def->replacement_list->count; ++i) {
+            PPToken* token = def->replacement_list->data[i];
+
+            if (token->kind == PP_WHITESPACE) {
+                continue;
+            }
+
+            if (replacement != nullptr) {
+                return false;
+            }
+
+            replacement = token;
+        }
+
+        if (replacement != nullptr && replacement->kind == PP_NUMBER) {
+            return parse_integer_constant(replacement->spelling, value);
+        }
+
+        if (replacement == nullptr || replacement->kind != PP_IDENTIFIER) {
+            return false;
+        }
+
+        name = replacement->spelling;
+    }
+}
+
+static IfValue if_apply_binary(IfOp* op, IfValue a, IfValue b) {
+    // the usual arithmetic conversions
+    bool is_unsigned = a.is_unsigned || b.is_unsigned;
+    s64 signed_a = (s64)a.value;
+    s64 signed_b = (s64)b.value;
+
+    switch (op->kind) {
+        case IF_OP_MULTIPLY:
+            return if_value(a.value * b.value, is_unsigned);
+
+        case IF_OP_DIVIDE:
+        case IF_OP_REMAINDER: {
+            if (b.value == 0) {
+                panic_pptoken(op->token, "division by zero in `#if`");
+            }
+
+            bool is_divide = op->kind == IF_OP_DIVIDE;
+
+            if (is_unsigned) {
+                return if_value(is_divide ? a.value / b.value : a.value % b.value, true);
+            }
+
+            // INTMAX_MIN / -1 would trap
+            if (signed_b == -1) {
+                return if_value(is_divide ? -a.value : 0, false);
+            }
+
+            return if_value(is_divide ? (u64)(signed_a / signed_b) : (u64)(signed_a % signed_b), false);
+        }
+
+        case IF_OP_ADD:
+            return if_value(a.value + b.value, is_unsigned);
+
+        case IF_OP_SUBTRACT:
+            return if_value(a.value - b.value, is_unsigned);
+
+        // shifts take the type of the left operand alone
+        case IF_OP_SHIFT_LEFT:
+            return if_value(b.value >= 64 ? 0 : a.value << b.value, a.is_unsigned);
+
+        case IF_OP_SHIFT_RIGHT:
+            if (a.is_unsigned) {
+                return if_value(b.value >= 64 ? 0 : a.value >> b.value, true);
+            }
+
+            return if_value(b.value >= 64 ? (signed_a < 0 ? ~0ULL : 0) : (u64)(signed_a >> b.value), false);
+
+        case IF_OP_LESS:
+            return if_bool(is_unsigned ? a.value < b.value : signed_a < signed_b);
+
+        case IF_OP_GREATER:
+            return if_bool(is_unsigned ? a.value > b.value : signed_a > signed_b);
+
+        case IF_OP_LESS_EQUAL:
+            return if_bool(is_unsigned ? a.value <= b.value : signed_a <= signed_b);
+
+        case IF_OP_GREATER_EQUAL:
+            return if_bool(is_unsigned ? a.value >= b.value : signed_a >= signed_b);
+
+        case IF_OP_EQUAL:
+            return if_bool(a.value == b.value);
+
+        case IF_OP_NOT_EQUAL:
+            return if_bool(a.value != b.value);
+
+        case IF_OP_BIT_AND:
+            return if_value(a.value & b.value, is_unsigned);
+
+        case IF_OP_BIT_XOR:
+            return if_value(a.value ^ b.value, is_unsigned);
+
+        case IF_OP_BIT_OR:
+            return if_value(a.value | b.value, is_unsigned);
+
+        default:
+            panic("not a binary `#if` operator");
+    }
+}
+
+/*
+Runs the bytecode. Returns false without a result when an
+identifier names a macro whose value takes real expansion.
+*/
+static bool if_expression_run(IfExpression* expression, IfValue* result) {
+    IfValueStack* stack = &g_if_stack;
+    stack->count = 0;
+
+    IfOpVector* ops = &expression->ops;
+    for (size_t i = 0; i < ops->count;) {
+        IfOp* op = &ops->data[i++];
+        IfValue* top = stack->count > 0 ? &stack->data[stack->count - 1] : nullptr;
+
+        switch (op->kind) {
+            case IF_OP_PUSH:
+                vector_push(stack, op->value);
+                break;
+
+            case IF_OP_IDENTIFIER: {
+                IfValue value;
+                if (!if_identifier_value(op->name, &value)) {
+                    return false;
+                }
+
+                vector_push(stack, value);
+                break;
+            }
+
+            case IF_OP_DEFINED:
+                vector_push(stack, if_bool(is_defined_for_condition(op->name)));
+                break;
+
+            case IF_OP_HAS_INCLUDE:
+                vector_push(stack, if_bool(header_exists(get_header_full_path(op->name, op->token))));
+                break;
+
+            case IF_OP_NEGATE:
+                top->value = -top->value;
+                break;
+
+            case IF_OP_COMPLEMENT:
+                top->value = ~top->value;
+                break;
+
+            case IF_OP_NOT:
+                *top = if_bool(top->value == 0);
+                break;
+
+            case IF_OP_TO_BOOL:
+                *top = if_bool(top->value != 0);
+                break;
+
+            case IF_OP_AND_THEN:
+                if (top->value == 0) {
+                    *top = if_bool(false);
+                    i = op->target;
+                }
+
+                else {
+                    stack->count--;
+                }
+                break;
+
+            case IF_OP_OR_ELSE:
+                if (top->value != 0) {
+                    *top = if_bool(true);
+                    i = op->target;
+                }
+
+                else {
+                    stack->count--;
+                }
+                break;
+
+            case IF_OP_JUMP_IF_FALSE:
+                stack->count--;
+                if (top->value == 0) {
+                    i = op->target;
+                }
+                break;
+
+            case IF_OP_JUMP:
+                i = op->target;
+                break;
+
+            default: {
+                IfValue b = stack->data[--stack->count];
+                IfValue a = stack->data[--stack->count];
+                vector_push(stack, if_apply_binary(op, a, b));
+                break;
+            }
+        }
+    }
+
+    *result = stack->data[0];
+    return true;
+}
+
+static size_t if_expression_bucket(FileDefinition* file, size_t offset, size_t bucket_count) {
+    u64 hash = ((u64)file >> 4) * 0x9e3779b97f4a7c15;
+    hash ^= (u64)offset * 0xc2b2ae3d27d4eb4f;
+    return (hash ^ (hash >> 29)) & (bucket_count - 1);
+}
+
+static void if_expression_cache_grow(IfExpressionCache* cache) {
+    size_t new_bucket_count = cache->bucket_count == 0 ? 64 : cache->bucket_count * 2;
+    IfExpressionEntry** new_buckets = ARENA_ALLOC(IfExpressionEntry*, new_bucket_count);
+    memset(new_buckets, 0, new_bucket_count * sizeof(IfExpressionEntry*));
+
+    for (size_t i = 0; i < cache->bucket_count; ++i) {
+        IfExpressionEntry* entry = cache->buckets[i];
+
+        while (entry != nullptr) {
+            IfExpressionEntry* next = entry->next_in_bucket;
+            size_t bucket = if_expression_bucket(entry->file, entry->offset, new_bucket_count);
+
+            entry->next_in_bucket = new_buckets[bucket];
+            new_buckets[bucket] = entry;
+
+            entry = next;
+        }
+    }
+
+    cache->buckets = new_buckets;
+    cache->bucket_count = new_bucket_count;
+}
+
+// the compiled condition of the directive named by directive_name
+static IfExpression* if_expression_get(PPToken* directive_name, PPTokenVector* condition) {
+    Byte* byte = pptoken_first_byte(directive_name);
+    FileDefinition* file = file_inclusion_resolve(byte->origin)->definition;
+    size_t offset = byte->offset;
+
+    IfExpressionCache* cache = &g_if_expressions;
+    if (cache->count >= cache->bucket_count) {
+        if_expression_cache_grow(cache);
+    }
+
+    size_t bucket = if_expression_bucket(file, offset, cache->bucket_count);
+    for (IfExpressionEntry* entry = cache->buckets[bucket]; entry != nullptr; entry = entry->next_in_bucket) {
+        if (entry->file == file && entry->offset == offset) {
+            return entry->expression;
+        }
+    }
+
+    IfExpressionEntry* entry = ARENA_ALLOC(IfExpressionEntry, 1);
+    entry->file = file;
+    entry->offset = offset;
+    entry->expression = if_compile(condition, false, directive_name);
+
+    entry->next_in_bucket = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    cache->count++;
+
+    return entry->expression;
+}
+
+static ExpandedToken* expanded_token_create(PPToken* pptoken, MacroInvocation* invoc, HideSet* hide_set);
+static ExpandedTokenVector* expand_argument(ExpandedTokenVector* arg);
+
+/*
+C23 6.10.2: `defined` and `__has_include` are evaluated before
+anything else, so that their operands are never expanded, the rest
+of the line is macro-expanded like any text.
+*/
+static PPTokenVector* expand_condition(PPTokenVector* condition, PPToken* directive_name) {
+    IfCompiler cursor = {
+        .tokens = condition,
+        .current_index = 0,
+        .expression = nullptr,
+        .is_expanded = false,
+        .error = nullptr,
+        .error_token = nullptr,
+    };
+
+    ExpandedTokenVector* tokens = ARENA_ALLOC(ExpandedTokenVector, 1);
+    while (cursor.current_index < condition->count) {
+        PPToken* token = condition->data[cursor.current_index++];
+        bool value = false;
+
+        if (pptoken_is(token, PP_IDENTIFIER, "defined")) {
+            PPToken* macro_name = if_parse_defined_operand(&cursor);
+            value = macro_name != nullptr && is_defined_for_condition(macro_name->spelling);
+        }
+
+        else if (pptoken_is(token, PP_IDENTIFIER, "__has_include")) {
+            char* header_name = if_parse_has_include_operand(&cursor);
+            value = header_name != nullptr && header_exists(get_header_full_path(header_name, token));
+        }
+
+        else {
+            vector_push(tokens, expanded_token_create(token, nullptr, nullptr));
+            continue;
+        }
+
+        if (cursor.error != nullptr) {
+            if_compiler_panic(&cursor, directive_name);
+        }
+
+        ExpandedToken* number = expanded_token_create(token, nullptr, nullptr);
+        number->kind = PP_NUMBER;
+        number->spelling = value ? "1" : "0";
+        number->length = 1;
+
+        vector_push(tokens, number);
+    }
+
+    ExpandedTokenVector* expanded_tokens = expand_argument(tokens);
+
+    PPTokenVector* expanded_condition = ARENA_ALLOC(PPTokenVector, 1);
+    for (size_t i = 0; i < expanded_tokens->count; ++i) {
+        ExpandedToken* expanded_token = expanded_tokens->data[i];
+
+        PPToken* pptoken = ARENA_ALLOC(PPToken, 1);
+        pptoken->kind = expanded_token->kind;
+        pptoken->spelling = expanded_token->spelling;
+        pptoken->length = expanded_token->length;
+        small_vector_copy(&pptoken->origin, &expanded_token->origin->origin);
+
+        vector_push(expanded_condition, pptoken);
+    }
+
+    return expanded_condition;
+}
+
+static bool if_evaluate(PPToken* directive_name, PPTokenVector* condition) {
+    IfExpression* expression = if_expression_get(directive_name, condition);
+    IfValue result;
+
+    if (expression->needs_expansion || !if_expression_run(expression, &result)) {
+        IfExpression* expanded = if_compile(expand_condition(condition, directive_name), true, directive_name);
+        if_expression_run(expanded, &result);
+    }
+
+    return result.value != 0;
+}
+
+/*
+Reads the condition of an #if, #ifdef, #ifndef or one of their
+#elif forms, the directive name is next in the stream.
+*/
+static bool evaluate_condition(PPTokenStream* stream) {
+    PPToken* directive_name = stream_peekahead(stream, 0);
+    char* name = directive_name->spelling;
+
+    stream_consume(stream, 1);
+    stream_skip_whitespace(stream);
+
+    if (streq(name, "if") || streq(name, "elif")) {
+        return if_evaluate(directive_name, gather_macro_replacement_tokens(stream));
+    }
+
+    PPToken* macro_name = stream_peekahead(stream, 0);
+    if (macro_name->kind != PP_IDENTIFIER) {
+        panic_pptoken(directive_name, "expected macro name after `#%s`", name);
+    }
+
+    bool is_negated = streq(name, "ifndef") || streq(name, "elifndef");
+    return is_defined_for_condition(macro_name->spelling) != is_negated;
+}
+
+static void record_if(PPTokenStream* stream) {
+    // nested in a skipped group, nothing in here is ever taken
+    ConditionalState state = COND_SATISFIED;
+
+    if (conditional_stack_top(&g_expander_context.conditional_stack) == COND_ACTIVE) {
+        state = evaluate_condition(stream) ? COND_ACTIVE : COND_SKIPPING;
+    }
+
+    conditional_stack_push(&g_expander_context.conditional_stack, state);
+
+    // clean up
+    stream_skip_line(stream);
+}
+
+static Conditional* current_conditional(PPToken* directive_name) {
+    ConditionalStack* stack = &g_expander_context.conditional_stack;
+
+    if (stack->count == 0) {
+        panic_pptoken(directive_name, "stray `#%s`", directive_name->spelling);
+    }
+
+    Conditional* conditional = &stack->data[stack->count - 1];
+    if (conditional->is_after_else) {
+        panic_pptoken(directive_name, "`#%s` after `#else`", directive_name->spelling);
+    }
+
+    return conditional;
+}
+
+static void record_elif(PPTokenStream* stream) {
+    Conditional* conditional = current_conditional(stream_peekahead(stream, 0));
+
+    if (conditional->state == COND_ACTIVE) {
+        conditional->state = COND_SATISFIED;
+    }
+
+    else if (conditional->state == COND_SKIPPING && evaluate_condition(stream)) {
+        conditional->state = COND_ACTIVE;
+    }
+
+    // clean up
+    stream_skip_line(stream);
+}
+
+static void record_else(PPTokenStream* stream) {
+    Conditional* conditional = current_conditional(stream_peekahead(stream, 0));
+
+    if (conditional->state == COND_ACTIVE) {
+        conditional->state = COND_SATISFIED;
+    }
+
+    else if (conditional->state == COND_SKIPPING) {
+        conditional->state = COND_ACTIVE;
+    }
+
+    conditional->is_after_else = true;
+
+    // clean up
+    stream_skip_line(stream);
+}
+
+static void record_endif(PPTokenStream* stream) {
+    if (g_expander_context.conditional_stack.count == 0) {
+        panic("stray `#endif`");
+    }
+
+    conditional_stack_pop(&g_expander_context.conditional_stack);
+
+    // clean up
+    stream_skip_line(stream);
+}
+
+static ExpansionFrame* expander_push_frame(Expander* ex, ExpandedTokenVector* tokens, HideSet* hide_set);
+
+// the tokens between the parentheses of an #embed parameter
+static PPTokenVector* embed_parameter_operand(PPTokenStream* stream, PPToken* parameter) {
+    stream_skip_whitespace(stream);
+
+    if (!pptoken_is(stream_peekahead(stream, 0), PP_PUNCTUATOR, "(")) {
+        panic_pptoken(parameter, "expected `(` after `%s`", parameter->spelling);
+    }
+
+    stream_consume(stream, 1);
+
+    PPTokenVector* operand = ARENA_ALLOC(PPTokenVector, 1);
+    size_t depth = 0;
+
+    while (true) {
+        PPToken* token = stream_peekahead(stream, 0);
+
+        if (token->kind == PP_NEWLINE || token->kind == PP_EOF) {
+            panic_pptoken(parameter, "expected `)`");
+        }
+
+        stream_consume(stream, 1);
+
+        if (pptoken_is(token, PP_PUNCTUATOR, "(")) {
+            depth++;
+        }
+
+        else if (pptoken_is(token, PP_PUNCTUATOR, ")")) {
+            if (depth == 0) {
+                break;
+            }
+
+            depth--;
+        }
+
+        vector_push(operand, token);
+    }
+
+    return operand;
+}
+
+// `__name__` is another spelling of every standard parameter `name`
+static bool is_embed_parameter(PPToken* parameter, char* name) {
+    char* spelling = parameter->spelling;
+    if (streq(spelling, name)) {
+        return true;
+    }
+
+    size_t length = strlen(spelling);
+    if (length != strlen(name) + 4 || spelling[0] != '_' || spelling[1] != '_' ||
+        spelling[length - 2] != '_' || spelling[length - 1] != '_') {
+        return false;
+    }
+
+    for (size_t i = 0; name[i] != '\0'; ++i) {
+        if (spelling[i + 2] != name[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void embed_push_tokens(ExpandedTokenVector* tokens, PPTokenVector* pptokens) {
+    if (pptokens == nullptr) {
+        return;
+    }
+
+    for (size_t i = 0; i < pptokens->count; ++i) {
+        ExpandedToken* token = expanded_token_create(pptokens->data[i], nullptr, nullptr);
+        vector_push(tokens, token);
+    }
+}
+
+// nullptr for an empty resource, which cannot be mapped
+static u8* map_resource(char* full_path, PPToken* resource_name, size_t* size) {
+    s32 fd = linux_open(full_path, LINUX_FILE_FLAG_READONLY, 0);
+    if (fd < 0) {
+        panic_pptoken(resource_name, "cannot open resource `%s`", full_path);
+    }
+
+    linux_stat_t stat;
+    if (linux_fstat(fd, &stat) < 0) {
+        panic_pptoken(resource_name, "cannot stat resource `%s`", full_path);
+    }
+
+    *size = stat.st_size;
+    u8* data = nullptr;
+
+    if (*size > 0) {
+        data = linux_mmap(nullptr, *size, LINUX_PROT_READ, LINUX_MAP_PRIVATE, fd, 0);
+
+        if (LINUX_MMAP_FAILED(data)) {
+            panic_pptoken(resource_name, "cannot map resource `%s`", full_path);
+        }
+    }
+
+    linux_close(fd);
+    return data;
+}
+
+/*
+C23 6.10.4: #embed stands for the bytes of a resource as a list of
+integer literals. The resource is mapped, never copied, and its
+bytes go out as a single PP_EMBED token that the output spells in
+bulk, with the prefix and suffix tokens around it. The newline of
+the directive is left in place, to end the list.
+*/
+static void expand_embed(Expander* ex) {
+    PPTokenStream* stream = &ex->includes.data[ex->includes.count - 1];
+
+    PPToken* directive_name = stream_peekahead(stream, 0);
+    stream_consume(stream, 1);
+    stream_skip_whitespace(stream);
+
+    PPToken* resource_name = stream_peekahead(stream, 0);
+    if (resource_name->kind != PP_HEADERNAME) {
+        panic_pptoken(directive_name, "expected resource name after `#embed`");
+    }
+
+    stream_consume(stream, 1);
+
+    bool has_limit = false;
+    u64 limit = 0;
+    PPTokenVector* prefix = nullptr;
+    PPTokenVector* suffix = nullptr;
+    PPTokenVector* if_empty = nullptr;
+
+    while (true) {
+        stream_skip_whitespace(stream);
+        PPToken* parameter = stream_peekahead(stream, 0);
+
+        if (parameter->kind == PP_NEWLINE || parameter->kind == PP_EOF) {
+            break;
+        }
+
+        if (parameter->kind != PP_IDENTIFIER) {
+            panic_pptoken(parameter, "expected #embed parameter");
+        }
+
+        stream_consume(stream, 1);
+        PPTokenVector* operand = embed_parameter_operand(stream, parameter);
+
+        if (is_embed_parameter(parameter, "limit")) {
+            IfExpression* expression = if_compile(expand_condition(operand, parameter), true, parameter);
+            IfValue value;
+            if_expression_run(expression, &value);
+
+            if (!value.is_unsigned && (s64)value.value < 0) {
+                panic_pptoken(parameter, "#embed limit cannot be negative");
+            }
+
+            has_limit = true;
+            limit = value.value;
+        }
+
+        else if (is_embed_parameter(parameter, "prefix")) {
+            prefix = operand;
+        }
+
+        else if (is_embed_parameter(parameter, "suffix")) {
+            suffix = operand;
+        }
+
+        else if (is_embed_parameter(parameter, "if_empty")) {
+            if_empty = operand;
+        }
+
+        else {
+            panic_pptoken(parameter, "unsupported #embed parameter `%s`", parameter->spelling);
+        }
+    }
+
+    size_t size = 0;
+    u8* data = map_resource(get_header_full_path(resource_name->spelling, resource_name), resource_name, &size);
+
+    if (has_limit && limit < size) {
+        size = limit;
+    }
+
+    ExpandedTokenVector* tokens = ARENA_ALLOC(ExpandedTokenVector, 1);
+
+    if (size == 0) {
+        embed_push_tokens(tokens, if_empty);
+    }
+
+    else {
+        embed_push_tokens(tokens, prefix);
+
+        ExpandedToken* bytes = ARENA_ALLOC(ExpandedToken, 1);
+        bytes->kind = PP_EMBED;
+        bytes->spelling = (char*)data;
+        bytes->length = size;
+        bytes->origin = resource_name;
+        bytes->invocation = nullptr;
+        bytes->hide_set = nullptr;
+        vector_push(tokens, bytes);
+
+        embed_push_tokens(tokens, suffix);
+    }
+
+    // prefix, suffix and if_empty are rescanned like any other text
+    if (tokens->count > 0) {
+        expander_push_frame(ex, tokens, nullptr);
+    }
+}
+
+static void execute_directive(Expander* ex) {
+    PPTokenStream* stream = &ex->includes.data[ex->includes.count - 1];
+
+    stream_consume(stream, 1);
+    stream_skip_whitespace(stream);
+
+    ConditionalState current_conditional_state = conditional_stack_top(&g_expander_context.conditional_stack);
+    PPToken* directive_name_token = stream_peekahead(stream, 0);
+
+    // These directives are only checked if we are not skipping
+    if (current_conditional_state == COND_ACTIVE) {
+        if (pptoken_is(directive_name_token, PP_IDENTIFIER, "include")) {
+            expand_include(ex);
+            return;
+        }
+
+        else if (pptoken_is(directive_name_token, PP_IDENTIFIER, "embed")) {
+            expand_embed(ex);
+            return;
+        }
+
+        else if (pptoken_is(directive_name_token, PP_IDENTIFIER, "define")) {
+            record_define(stream);
+            return;
+        }
+
+        else if (pptoken_is(directive_name_token, PP_IDENTIFIER, "undef")) {
+            record_undef(stream);
+            return;
+        }
+    }
+
+    if (pptoken_is(directive_name_token, PP_IDENTIFIER, "if") ||
+        pptoken_is(directive_name_token, PP_IDENTIFIER, "ifdef") ||
+        pptoken_is(directive_name_token, PP_IDENTIFIER, "ifndef")) {
+        record_if(stream);
+    }
+
+    else if (pptoken_is(directive_name_token, PP_IDENTIFIER, "elif") ||
+             pptoken_is(directive_name_token, PP_IDENTIFIER, "elifdef") ||
+             pptoken_is(directive_name_token, PP_IDENTIFIER, "elifndef")) {
+        record_elif(stream);
+    }
+
+    else if (pptoken_is(directive_name_token, PP_IDENTIFIER, "else")) {
+        record_else(stream);
+    }
+
+    else if (pptoken_is(directive_name_token, PP_IDENTIFIER, "endif")) {
+        record_endif(stream);
+    }
+
+    else {
+        // null directive or nondirective. Just forget this line.
+        stream_skip_line(stream);
+    }
+}
+
+/*
+Hide sets are big-endian Patricia trees over macro ids. Nodes are
+hash-consed and Patricia trees are canonical, so equal sets are
+always the same pointer and the empty set is nullptr. Adding an id,
+membership, union and intersection all walk at most 32 levels.
+*/
+struct HideSet {
+    u32 prefix;      // the id itself for a leaf
+    u32 branch_bit;  // 0 for a leaf
+    HideSet* zero;   // ids with branch_bit clear
+    HideSet* one;    // ids with branch_bit set
+
+    HideSet* next_in_bucket;
+};
+
+typedef struct HideSetTable {
+    HideSet** buckets;
+    size_t bucket_count;
+    size_t count;
+} HideSetTable;
+
+static HideSetTable g_hide_sets = {0};
+
+static u32 hideset_highest_bit(u32 x) {
+    x |= x >> 1;
+    x |= x >> 2;
+    x |= x >> 4;
+    x |= x >> 8;
+    x |= x >> 16;
+    return x ^ (x >> 1);
+}
+
+// the bits of id above branch_bit
+static u32 hideset_mask(u32 id, u32 branch_bit) {
+    return (u32)(id & ~(((u64)branch_bit << 1) - 1));
+}
+
+static bool hideset_matches(HideSet* set, u32 id) {
+    return hideset_mask(id, set->branch_bit) == set->prefix;
+}
+
+static size_t hideset_bucket(u32 prefix, u32 branch_bit, HideSet* zero, HideSet* one, size_t bucket_count) {
+    u64 hash = ((u64)prefix << 32 | branch_bit) * 0x9e3779b97f4a7c15;
+    hash ^= ((u64)zero >> 4) * 0xc2b2ae3d27d4eb4f;
+    hash ^= ((u64)one >> 4) * 0x165667b19e3779f9;
+    return (hash ^ (hash >> 29)) & (bucket_count - 1);
+}
+
+static void hideset_table_grow(HideSetTable* table) {
+    size_t new_bucket_count = table->bucket_count == 0 ? 64 : table->bucket_count * 2;
+    HideSet** new_buckets = ARENA_ALLOC(HideSet*, new_bucket_count);
+    memset(new_buckets, 0, new_bucket_count * sizeof(HideSet*));
+
+    for (size_t i = 0; i < table->bucket_count; ++i) {
+        HideSet* set = table->buckets[i];
+
+        while (set != nullptr) {
+            HideSet* next = set->next_in_bucket;
+            size_t bucket = hideset_bucket(set->prefix, set->branch_bit, set->zero, set->one, new_bucket_count);
+
+            set->next_in_bucket = new_buckets[bucket];
+            new_buckets[bucket] = set;
+
+            set = next;
+        }
+    }
+
+    table->buckets = new_buckets;
+    table->bucket_count = new_bucket_count;
+}
+
+static HideSet* hideset_node(u32 prefix, u32 branch_bit, HideSet* zero, HideSet* one) {
+    HideSetTable* table = &g_hide_sets;
+    if (table->count >= table->bucket_count) {
+        hideset_table_grow(table);
+    }
+
+    size_t bucket = hideset_bucket(prefix, branch_bit, zero, one, table->bucket_count);
+    for (HideSet* set = table->buckets[bucket]; set != nullptr; set = set->next_in_bucket) {
+        if (set->prefix == prefix && set->branch_bit == branch_bit &&
+            set->zero == zero && set->one == one) {
+            return set;
+        }
+    }
+
+    HideSet* set = ARENA_ALLOC(HideSet, 1);
+    set->prefix = prefix;
+    set->branch_bit = branch_bit;
+    set->zero = zero;
+    set->one = one;
+
+    set->next_in_bucket = table->buckets[bucket];
+    table->buckets[bucket] = set;
+    table->count++;
+
+    return set;
+}
+
+static HideSet* hideset_leaf(u32 id) {
+    return hideset_node(id, 0, nullptr, nullptr);
+}
+
+// a branch, unless one side is empty
+static HideSet* hideset_branch(u32 prefix, u32 branch_bit, HideSet* zero, HideSet* one) {
+    if (zero == nullptr) return one;
+    if (one == nullptr) return zero;
+    return hideset_node(prefix, branch_bit, zero, one);
+}
+
+// joins two disjoint trees whose prefixes differ
+static HideSet* hideset_join(u32 prefix0, HideSet* set0, u32 prefix1, HideSet* set1) {
+    u32 branch_bit = hideset_highest_bit(prefix0 ^ prefix1);
+    u32 prefix = hideset_mask(prefix0, branch_bit);
+
+    if ((prefix0 & branch_bit) == 0) {
+        return hideset_node(prefix, branch_bit, set0, set1);
+    }
+
+    else {
+        return hideset_node(prefix, branch_bit, set1, set0);
+    }
+}
+
+static bool hideset_contains(HideSet* set, u32 id) {
+    while (set != nullptr) {
+        if (set->branch_bit == 0) {
+            return set->prefix == id;
+        }
+
+        if (!hideset_matches(set, id)) {
+            return false;
+        }
+
+        set = (id & set->branch_bit) ? set->one : set->zero;
+    }
+
+    return false;
+}
+
+static HideSet* hideset_add(HideSet* set, u32 id) {
+    if (set == nullptr) {
+        return hideset_leaf(id);
+    }
+
+    if (set->branch_bit == 0) {
+        if (set->prefix == id) return set;
+        return hideset_join(id, hideset_leaf(id), set->prefix, set);
+    }
+
+    if (!hideset_matches(set, id)) {
+        return hideset_join(id, hideset_leaf(id), set->prefix, set);
+    }
+
+    if (id & set->branch_bit) {
+        return hideset_node(set->prefix, set->branch_bit, set->zero, hideset_add(set->one, id));
+    }
+
+    else {
+        return hideset_node(set->prefix, set->branch_bit, hideset_add(set->zero, id), set->one);
+    }
+}
+
+static HideSet* hideset_union(HideSet* a, HideSet* b) {
+    if (a == nullptr || a == b) return b;
+    if (b == nullptr) return a;
+
+    if (a->branch_bit == 0) return hideset_add(b, a->prefix);
+    if (b->branch_bit == 0) return hideset_add(a, b->prefix);
+
+    if (a->branch_bit == b->branch_bit && a->prefix == b->prefix) {
+        return hideset_node(
+            a->prefix,
+            a->branch_bit,
+            hideset_union(a->zero, b->zero),
+            hideset_union(a->one, b->one)
+        );
+    }
+
+    // b fits below a
+    if (a->branch_bit > b->branch_bit && hideset_matches(a, b->prefix)) {
+        if (b->prefix & a->branch_bit) {
+            return hideset_node(a->prefix, a->branch_bit, a->zero, hideset_union(a->one, b));
+        }
+
+        else {
+            return hideset_node(a->prefix, a->branch_bit, hideset_union(a->zero, b), a->one);
+        }
+    }
+
+    // a fits below b
+    if (b->branch_bit > a->branch_bit && hideset_matches(b, a->prefix)) {
+        if (a->prefix & b->branch_bit) {
+            return hideset_node(b->prefix, b->branch_bit, b->zero, hideset_union(a, b->one));
+        }
+
+        else {
+            return hideset_node(b->prefix, b->branch_bit, hideset_union(a, b->zero), b->one);
+        }
+    }
+
+    return hideset_join(a->prefix, a, b->prefix, b);
+}
+
+static HideSet* hideset_intersection(HideSet* a, HideSet* b) {
+    if (a == nullptr || b == nullptr) return nullptr;
+    if (a == b) return a;
+
+    if (a->branch_bit == 0) return hideset_contains(b, a->prefix) ? a : nullptr;
+    if (b->branch_bit == 0) return hideset_contains(a, b->prefix) ? b : nullptr;
+
+    if (a->branch_bit == b->branch_bit && a->prefix == b->prefix) {
+        return hideset_branch(
+            a->prefix,
+            a->branch_bit,
+            hideset_intersection(a->zero, b->zero),
+            hideset_intersection(a->one, b->one)
+        );
+    }
+
+    if (a->branch_bit > b->branch_bit) {
+        if (!hideset_matches(a, b->prefix)) return nullptr;
+        return hideset_intersection((b->prefix & a->branch_bit) ? a->one : a->zero, b);
+    }
+
+    if (b->branch_bit > a->branch_bit) {
+        if (!hideset_matches(b, a->prefix)) return nullptr;
+        return hideset_intersection(a, (a->prefix & b->branch_bit) ? b->one : b->zero);
+    }
+
+    return nullptr;
+}
+
+static bool expanded_token_is(ExpandedToken* token, PPTokenKind kind, char* spelling) {
+    if (token->kind != kind) return false;
+    return streq(token->spelling, spelling);
+}
+
+static ExpandedToken* expanded_token_create(PPToken* pptoken, MacroInvocation* invoc, HideSet* hide_set) {
+    ExpandedToken* expanded_token = ARENA_ALLOC(ExpandedToken, 1);
+    expanded_token->kind = pptoken->kind;
+    expanded_token->spelling = strdup(pptoken->spelling);
+    expanded_token->length = pptoken->length;
+    expanded_token->origin = pptoken;
+    expanded_token->invocation = invoc;
+    expanded_token->hide_set = hide_set;
+
+    return expanded_token;
+}
+
+static ExpandedToken* expanded_token_with_hide_set(ExpandedToken* token, HideSet* hide_set) {
+    if (token->hide_set == hide_set) {
+        return token;
+    }
+
+    ExpandedToken* copy = ARENA_ALLOC(ExpandedToken, 1);
+    *copy = *token;
+    copy->hide_set = hide_set;
+
+    return copy;
+}
+
+static void dependency_set_add(MacroDependencySet* set, char* name, MacroDefinition* definition);
+
+static void dependency_set_grow(MacroDependencySet* set) {
+    MacroDependencySet grown = {
+        .slots = nullptr,
+        .capacity = set->capacity == 0 ? 16 : set->capacity * 2,
+        .count = 0,
+    };
+    grown.slots = ARENA_ALLOC(MacroDependency, grown.capacity);
+
+    for (size_t i = 0; i < set->capacity; ++i) {
+        if (set->slots[i].name != nullptr) {
+            dependency_set_add(&grown, set->slots[i].name, set->slots[i].definition);
+        }
+    }
+
+    *set = grown;
+}
+
+// keeps the first definition seen for a name
+static void dependency_set_add(MacroDependencySet* set, char* name, MacroDefinition* definition) {
+    if (2 * (set->count + 1) > set->capacity) {
+        dependency_set_grow(set);
+    }
+
+    size_t mask = set->capacity - 1;
+    for (size_t i = hash_string(name) & mask;; i = (i + 1) & mask) {
+        MacroDependency* slot = &set->slots[i];
+
+        if (slot->name == nullptr) {
+            slot->name = name;
+            slot->definition = definition;
+            set->count++;
+            return;
+        }
+
+        if (streq(slot->name, name)) {
+            return;
+        }
+    }
+}
+
+static bool dependency_set_is_current(MacroDependencySet* set) {
+    for (size_t i = 0; i < set->capacity; ++i) {
+        MacroDependency* slot = &set->slots[i];
+
+        if (slot->name != nullptr && is_defined(slot->name) != slot->definition) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+Looks a name up for expansion. While an expansion is recorded,
+what the name meant is remembered, since a later #define of it
+would change the result.
+*/
+static MacroDefinition* lookup_macro(char* name) {
+    MacroDefinition* def = is_defined(name);
+
+    if (g_memo.recording != nullptr) {
+        dependency_set_add(&g_memo.recording->dependencies, name, def);
+    }
+
+    return def;
+}
+
+static u64 memo_mix(u64 hash, u64 value) {
+    return (hash ^ value) * 0x100000001b3;
+}
+
+static u64 memo_fingerprint(MacroDefinition* def, HideSet* hide_set, ExpandedTokenVectorVector* args) {
+    u64 hash = memo_mix(0xcbf29ce484222325, def->id);
+    hash = memo_mix(hash, (u64)hide_set >> 4);
+
+    if (args == nullptr) {
+        return hash;
+    }
+
+    for (size_t i = 0; i < args->count; ++i) {
+        ExpandedTokenVector* arg = args->data[i];
+        hash = memo_mix(hash, arg->count);
+
+        for (size_t j = 0; j < arg->count; ++j) {
+            ExpandedToken* token = arg->data[j];
+            hash = memo_mix(hash, token->kind);
+            hash = memo_mix(hash, hash_string(token->spelling));
+            hash = memo_mix(hash, (u64)token->hide_set >> 4);
+        }
+    }
+
+    return hash;
+}
+
+static bool memo_arguments_equal(ExpandedTokenVectorVector* a, ExpandedTokenVectorVector* b) {
+    if (a == nullptr || b == nullptr) {
+        return a == b;
+    }
+
+    if (a->count != b->count) {
+        return false;
+    }
+
+    for (size_t i = 0; i < a->count; ++i) {
+        ExpandedTokenVector* arg_a = a->data[i];
+        ExpandedTokenVector* arg_b = b->data[i];
+
+        if (arg_a->count != arg_b->count) {
+            return false;
+        }
+
+        for (size_t j = 0; j < arg_a->count; ++j) {
+            ExpandedToken* token_a = arg_a->data[j];
+            ExpandedToken* token_b = arg_b->data[j];
+
+            if (token_a->kind != token_b->kind || token_a->hide_set != token_b->hide_set ||
+                !streq(token_a->spelling, token_b->spelling)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static size_t memo_bucket(u64 fingerprint, size_t bucket_count) {
+    return (fingerprint ^ (fingerprint >> 29)) & (bucket_count - 1);
+}
+
+static void memo_grow(ExpansionMemo* memo) {
+    size_t new_bucket_count = memo->bucket_count == 0 ? 64 : memo->bucket_count * 2;
+    MemoEntry** new_buckets = ARENA_ALLOC(MemoEntry*, new_bucket_count);
+    memset(new_buckets, 0, new_bucket_count * sizeof(MemoEntry*));
+
+    for (size_t i = 0; i < memo->bucket_count; ++i) {
+        MemoEntry* entry = memo->buckets[i];
+
+        while (entry != nullptr) {
+            MemoEntry* next = entry->next_in_bucket;
+            size_t bucket = memo_bucket(entry->fingerprint, new_bucket_count);
+
+            entry->next_in_bucket = new_buckets[bucket];
+            new_buckets[bucket] = entry;
+
+            entry = next;
+        }
+    }
+
+    memo->buckets = new_buckets;
+    memo->bucket_count = new_bucket_count;
+}
+
+/*
+The remembered expansion for the key, nullptr if there is none or
+a macro it depends on has been defined or undefined since.
+Stale entries are dropped on the way.
+*/
+static MemoEntry* memo_find(MacroDefinition* def, HideSet* hide_set, ExpandedTokenVectorVector* args, u64 fingerprint) {
+    ExpansionMemo* memo = &g_memo;
+    if (memo->bucket_count == 0) {
+        return nullptr;
+    }
+
+    MemoEntry** link = &memo->buckets[memo_bucket(fingerprint, memo->bucket_count)];
+    for (MemoEntry* entry = *link; entry != nullptr; link = &entry->next_in_bucket, entry = *link) {
+        if (entry->fingerprint != fingerprint || entry->definition != def || entry->hide_set != hide_set ||
+            !memo_arguments_equal(entry->arguments, args)) {
+            continue;
+        }
+
+        if (entry->generation != g_expander_context.generation) {
+            if (!dependency_set_is_current(&entry->dependencies)) {
+                *link = entry->next_in_bucket;
+                memo->count--;
+                return nullptr;
+            }
+
+            entry->generation = g_expander_context.generation;
+        }
+
+        return entry;
+    }
+
+    return nullptr;
+}
+
+static void memo_insert(MemoEntry* entry) {
+    ExpansionMemo* memo = &g_memo;
+    if (memo->count >= memo->bucket_count) {
+        memo_grow(memo);
+    }
+
+    size_t bucket = memo_bucket(entry->fingerprint, memo->bucket_count);
+    entry->next_in_bucket = memo->buckets[bucket];
+    memo->buckets[bucket] = entry;
+    memo->count++;
+}
+
+static MemoEntry* memo_begin(Expander* ex, MacroInvocation* invoc, HideSet* hide_set, u64 fingerprint) {
+    MemoEntry* entry = ARENA_ALLOC(MemoEntry, 1);
+    entry->definition = invoc->definition;
+    entry->hide_set = hide_set;
+    entry->arguments = invoc->arguments;
+    entry->fingerprint = fingerprint;
+    entry->invocation = invoc;
+    entry->expansion = ARENA_ALLOC(ExpandedTokenVector, 1);
+
+    g_memo.recording = entry;
+    g_memo.recording_expander = ex;
+    return entry;
+}
+
+static void memo_abandon(void) {
+    g_memo.recording = nullptr;
+    g_memo.recording_expander = nullptr;
+}
+
+/*
+The recorded frame has run out with nothing pending, so the tokens
+handed out since it was pushed are the whole expansion. It is only
+kept if it ends in no function-like macro name, which could still
+take its arguments from whatever follows the invocation.
+*/
+static void memo_finish(MemoEntry* entry) {
+    memo_abandon();
+
+    ExpandedTokenVector* expansion = entry->expansion;
+    for (size_t i = expansion->count; i > 0; --i) {
+        ExpandedToken* token = expansion->data[i - 1];
+
+        if (token->kind == PP_WHITESPACE || token->kind == PP_NEWLINE) {
+            continue;
+        }
+
+        if (token->kind == PP_IDENTIFIER) {
+            MacroDefinition* def = is_defined(token->spelling);
+
+            if (def != nullptr && def->is_function_like && !hideset_contains(token->hide_set, def->id)) {
+                return;
+            }
+        }
+
+        break;
+    }
+
+    entry->generation = g_expander_context.generation;
+    memo_insert(entry);
+}
+
+// what becomes of an exhausted frame that carries a recording
+typedef enum FramePopKind {
+    FRAME_POP_SETTLED,      // between two tokens handed out, the recording is complete
+    FRAME_POP_BEFORE_PUSH,  // the frame about to be pushed still belongs to the recording
+    FRAME_POP_MID_READ,     // the expansion reads past its own tokens, the recording is useless
+} FramePopKind;
+
+static void expander_pop_exhausted_frames(Expander* ex, FramePopKind kind) {
+    while (ex->frames.count > 0) {
+        ExpansionFrame* top = &ex->frames.data[ex->frames.count - 1];
+
+        if (top->current_index < top->tokens->count) {
+            break;
+        }
+
+        if (top->recording != nullptr && top->recording == g_memo.recording) {
+            if (kind == FRAME_POP_BEFORE_PUSH) {
+                break;
+            }
+
+            if (kind == FRAME_POP_SETTLED) {
+                memo_finish(top->recording);
+            }
+
+            else {
+                memo_abandon();
+            }
+        }
+
+        ex->frames.count--;
+    }
+}
+
+static ExpansionFrame* expander_push_frame(Expander* ex, ExpandedTokenVector* tokens, HideSet* hide_set) {
+    // keeps the stack flat for macros invoked at the very end of a body
+    expander_pop_exhausted_frames(ex, FRAME_POP_BEFORE_PUSH);
+
+    ExpansionFrame frame = {
+        .tokens = tokens,
+        .current_index = 0,
+        .hide_set = hide_set,
+        .is_expanded = false,
+        .recording = nullptr,
+    };
+
+    vector_push(&ex->frames, frame);
+    return &ex->frames.data[ex->frames.count - 1];
+}
+
+// the innermost open file, nullptr if there is none
+static PPTokenStream* expander_source(Expander* ex) {
+    if (ex->includes.count == 0) {
+        return nullptr;
+    }
+
+    return &ex->includes.data[ex->includes.count - 1];
+}
+
+/*
+Consumes the next token, from the innermost frame if there is
+one, else from the source stream. Returns nullptr at the end.
+*/
+static ExpandedToken* expander_read(Expander* ex) {
+    expander_pop_exhausted_frames(ex, FRAME_POP_MID_READ);
+
+    if (ex->frames.count > 0) {
+        ExpansionFrame* top = &ex->frames.data[ex->frames.count - 1];
+        ExpandedToken* token = top->tokens->data[top->current_index++];
+
+        if (top->hide_set != nullptr &&
+            (token->kind == PP_IDENTIFIER || expanded_token_is(token, PP_PUNCTUATOR, ")"))) {
+            token = expanded_token_with_hide_set(token, hideset_union(token->hide_set, top->hide_set));
+        }
+
+        return token;
+    }
+
+    // Reading never crosses the end of a file.
+    PPTokenStream* stream = expander_source(ex);
+    if (stream == nullptr) {
+        return nullptr;
+    }
+
+    PPToken* pptoken = stream_peekahead(stream, 0);
+    if (pptoken->kind == PP_EOF) {
+        return nullptr;
+    }
+
+    stream_consume(stream, 1);
+    return expanded_token_create(pptoken, nullptr, nullptr);
+}
+
+/*
+Looks past whitespace and newlines, without consuming anything,
+for the `(` that would make a function-like macro name an invocation.
+*/
+static bool expander_is_lparen_next(Expander* ex) {
+    for (size_t i = ex->frames.count; i > 0; --i) {
+        ExpansionFrame* frame = &ex->frames.data[i - 1];
+
+        for (size_t j = frame->current_index; j < frame->tokens->count; ++j) {
+            ExpandedToken* token = frame->tokens->data[j];
+
+            if (token->kind == PP_WHITESPACE || token->kind == PP_NEWLINE) {
+                continue;
+            }
+
+            return expanded_token_is(token, PP_PUNCTUATOR, "(");
+        }
+    }
+
+    PPTokenStream* stream = expander_source(ex);
+    if (stream == nullptr) {
+        return false;
+    }
+
+    for (ssize_t offset = 0;; ++offset) {
+        PPToken* pptoken = stream_peekahead(stream, offset);
+
+        if (pptoken->kind == PP_WHITESPACE || pptoken->kind == PP_NEWLINE) {
+            continue;
+        }
+
+        return pptoken_is(pptoken, PP_PUNCTUATOR, "(");
+    }
+}
+
+/*
+Reads the arguments of a function-like macro invocation, the `(`
+has already been consumed. Returns the hide set of the closing `)`.
+*/
+static HideSet* record_args(Expander* ex, MacroInvocation* invoc) {
+    MacroDefinition* def = invoc->definition;
+    size_t param_count = def->params->count;
+
+    ExpandedTokenVectorVector* args = ARENA_ALLOC(ExpandedTokenVectorVector, 1);
+    ExpandedTokenVector* arg = ARENA_ALLOC(ExpandedTokenVector, 1);
+
+    HideSet* rparen_hide_set = nullptr;
+    size_t paren_depth = 0;
+    while (true) {
+        ExpandedToken* token = expander_read(ex);
+
+        if (token == nullptr) {
+            panic_invocation(invoc, "unterminated invocation of macro `%s`", def->name);
+        }
+
+        // Named arguments start at their first non-whitespace token,
+        // the variable arguments keep what follows their comma.
+        if (arg->count == 0 &&
+            (token->kind == PP_WHITESPACE || token->kind == PP_NEWLINE) &&
+            (args->count < param_count || args->count == 0)) {
+            continue;
+        }
+
+        if (expanded_token_is(token, PP_PUNCTUATOR, ")") && paren_depth == 0) {
+            rparen_hide_set = token->hide_set;
+            vector_push(args, arg);
+            break;
+        }
+
+        if (expanded_token_is(token, PP_PUNCTUATOR, ",") && paren_depth == 0 &&
+            (!def->is_variadic || args->count < param_count)) {
+            vector_push(args, arg);
+            arg = ARENA_ALLOC(ExpandedTokenVector, 1);
+            continue;
+        }
+
+        if (expanded_token_is(token, PP_PUNCTUATOR, "(")) {
+            paren_depth++;
+        }
+
+        else if (expanded_token_is(token, PP_PUNCTUATOR, ")")) {
             paren_depth--;
-            vector_push(va_args, token);
-            stream_consume(stream, 1);
+        }
+
+        vector_push(arg, token);
+    }
+
+    // `F()` passes one empty argument, which is no argument at all
+    // for a macro without parameters.
+    if (param_count == 0 && !def->is_variadic && args->data[0]->count == 0) {
+        args->count = 0;
+    }
+
+    if (args->count < param_count) {
+        panic_invocation(invoc, "too few arguments in invocation of macro `%s`", def->name);
+    }
+
+    if (!def->is_variadic && args->count > param_count) {
+        panic_invocation(invoc, "too many arguments in invocation of macro `%s`", def->name);
+    }
+
+    invoc->are_va_args_present = false;
+    if (def->is_variadic) {
+        if (args->count == param_count) {
+            vector_push(args, ARENA_ALLOC(ExpandedTokenVector, 1));
+        }
+
+        ExpandedTokenVector* va_args = args->data[param_count];
+        for (size_t i = 0; i < va_args->count; ++i) {
+            PPTokenKind kind = va_args->data[i]->kind;
+
+            if (kind != PP_WHITESPACE && kind != PP_NEWLINE) {
+                invoc->are_va_args_present = true;
+                break;
+            }
+        }
+    }
+
+    invoc->arguments = args;
+
+    invoc->expanded_arguments = ARENA_ALLOC(ExpandedTokenVectorVector, 1);
+    invoc->expanded_arguments->data = ARENA_ALLOC(ExpandedTokenVector*, args->count);
+    invoc->expanded_arguments->count = args->count;
+    invoc->expanded_arguments->capacity = args->count;
+    memset(invoc->expanded_arguments->data, 0, args->count * sizeof(ExpandedTokenVector*));
+
+    return rparen_hide_set;
+}
+
+static ExpandedToken* expander_next(Expander* ex);
+
+/*
+Fully macro-expands an argument on its own, as if it
+formed the rest of the translation unit.
+*/
+static ExpandedTokenVector* expand_argument(ExpandedTokenVector* arg) {
+    Expander ex = {
+        .includes = {0},
+        .frames = {0},
+    };
+
+    expander_push_frame(&ex, arg, nullptr);
+
+    ExpandedTokenVector* expanded_arg = ARENA_ALLOC(ExpandedTokenVector, 1);
+    for (ExpandedToken* token = expander_next(&ex); token != nullptr; token = expander_next(&ex)) {
+        vector_push(expanded_arg, token);
+    }
+
+    return expanded_arg;
+}
+
+/*
+C23 6.10.5.1: an argument is macro-expanded before substitution.
+This happens at most once per invocation, however many times the
+parameter appears in the body, and every occurrence splices in
+the same expanded tokens.
+*/
+static ExpandedTokenVector* get_expanded_argument(MacroInvocation* invoc, size_t index) {
+    ExpandedTokenVector** expanded_arg = &invoc->expanded_arguments->data[index];
+
+    if (*expanded_arg == nullptr) {
+        *expanded_arg = expand_argument(invoc->arguments->data[index]);
+    }
+
+    return *expanded_arg;
+}
+
+static bool is_whitespace_kind(PPTokenKind kind) {
+    return kind == PP_WHITESPACE || kind == PP_NEWLINE;
+}
+
+/*
+C23 6.10.5.2: __VA_OPT__ keeps its group only if the variable
+arguments still hold tokens once fully expanded, so `F(EMPTY)`
+with an empty EMPTY has none, however it was spelled.
+*/
+static bool are_expanded_va_args_present(MacroInvocation* invoc) {
+    if (!invoc->are_va_args_present) {
+        return false;
+    }
+
+    ExpandedTokenVector* va_args = get_expanded_argument(invoc, invoc->arguments->count - 1);
+    for (size_t i = 0; i < va_args->count; ++i) {
+        if (!is_whitespace_kind(va_args->data[i]->kind)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// [*first, *end) is arg without its leading and trailing whitespace
+static void trim_argument(ExpandedTokenVector* arg, size_t* first, size_t* end) {
+    *first = 0;
+    *end = arg->count;
+
+    while (*first < *end && is_whitespace_kind(arg->data[*first]->kind)) {
+        (*first)++;
+    }
+
+    while (*end > *first && is_whitespace_kind(arg->data[*end - 1]->kind)) {
+        (*end)--;
+    }
+}
+
+/*
+C23 6.10.5.2: whitespace between the tokens of the argument becomes
+one space, and `"` and `\` inside string literals and character
+constants are escaped. The length is known after one pass over the
+argument, so the spelling is allocated exactly once.
+*/
+static ExpandedToken* stringize(MacroOp* op, ExpandedTokenVector* arg, MacroInvocation* invoc, HideSet* hide_set) {
+    size_t first, end;
+    trim_argument(arg, &first, &end);
+
+    size_t length = 2;
+    for (size_t i = first; i < end; ++i) {
+        ExpandedToken* token = arg->data[i];
+
+        if (is_whitespace_kind(token->kind)) {
+            if (!is_whitespace_kind(arg->data[i - 1]->kind)) {
+                length++;
+            }
+
             continue;
         }
 
-        else if (pptoken_is(token, PP_PUNCTUATOR, "(")) {
-            paren_depth++;
-            vector_push(va_args, token);
-            stream_consume(stream, 1);
+        length += token->length;
+
+        if (token->kind == PP_STRING || token->kind == PP_CHAR) {
+            for (size_t j = 0; j < token->length; ++j) {
+                if (token->spelling[j] == '\"' || token->spelling[j] == '\\') {
+                    length++;
+                }
+            }
+        }
+    }
+
+    char* spelling = ARENA_ALLOC(char, length + 1);
+    size_t index = 0;
+
+    spelling[index++] = '\"';
+    for (size_t i = first; i < end; ++i) {
+        ExpandedToken* token = arg->data[i];
+
+        if (is_whitespace_kind(token->kind)) {
+            if (!is_whitespace_kind(arg->data[i - 1]->kind)) {
+                spelling[index++] = ' ';
+            }
+
             continue;
         }
 
-        else {
-            vector_push(va_args, token);
-            stream_consume(stream, 1);
-            continue;
+        bool is_escaped = token->kind == PP_STRING || token->kind == PP_CHAR;
+        for (size_t j = 0; j < token->length; ++j) {
+            char c = token->spelling[j];
+
+            if (is_escaped && (c == '\"' || c == '\\')) {
+                spelling[index++] = '\\';
+            }
+
+            spelling[index++] = c;
         }
     }
+    spelling[index++] = '\"';
+    spelling[index] = '\0';
+
+    ExpandedToken* string = expanded_token_create(op->token, invoc, hide_set);
+    string->kind = PP_STRING;
+    string->spelling = spelling;
+    string->length = length;
 
-    return va_args;
+    return string;
 }
 
-static void record_args(MacroInvocation* invoc, PPTokenStream* stream) {
-    // Eat the opening parenthesis
-    stream_consume(stream, 1);
+typedef struct PasteBuffer {
+    char* data;
+    size_t count;
+    size_t capacity;
+} PasteBuffer;
 
-    MacroDefinition* def = invoc->definition;
+static PasteBuffer g_paste_buffer = {0};
 
-    PPTokenVectorVector* args = ARENA_ALLOC(PPTokenVectorVector, 1);
+/*
+C23 6.10.5.3: the two spellings are joined in a scratch buffer and
+lexed again, they must form exactly one preprocessing token.
+*/
+static ExpandedToken* paste_tokens(ExpandedToken* left, ExpandedToken* right, MacroInvocation* invoc) {
+    PasteBuffer* buffer = &g_paste_buffer;
+    buffer->count = 0;
 
-    // This loop grabs the first N - 1 REQUIRED args.
-    for (size_t i = 0; i + 1 < def->params->count; ++i) {
-        stream_skip_whitespace_and_newline(stream);
+    for (size_t i = 0; i < left->length; ++i) {
+        vector_push(buffer, left->spelling[i]);
+    }
 
-        PPTokenVector* reqd_arg = record_arg(stream);
-        vector_push(args, reqd_arg);
+    for (size_t i = 0; i < right->length; ++i) {
+        vector_push(buffer, right->spelling[i]);
+    }
 
-        if (!pptoken_is(stream_peekahead(stream, 0), PP_PUNCTUATOR, ",")) {
-            panic("expected `,`");
-        }
+    vector_push(buffer, '\0');
 
-        stream_consume(stream, 1);
-        continue;
+    PPToken* pptoken = retokenize(buffer->data, spliced_char_resolve(left->origin->origin.data[0]));
+
+    if (pptoken == nullptr) {
+        panic_invocation(invoc, "pasting `%s` and `%s` does not give a valid preprocessing token", left->spelling, right->spelling);
     }
 
-    stream_skip_whitespace_and_newline(stream);
+    // Prosser: the pasted token keeps what both sides had hidden
+    return expanded_token_create(pptoken, invoc, hideset_intersection(left->hide_set, right->hide_set));
+}
 
-    // Grab the last REQUIRED arg
-    if (args->count < def->params->count) {
-        PPTokenVector* last_reqd_arg = record_arg(stream);
-        vector_push(args, last_reqd_arg);
-    }
+/*
+The output of replace_params() while it is being written. Each
+op writes one operand, an operand right after a `##` has its
+first token pasted onto the last token of the one before.
+*/
+typedef struct Substitution {
+    ExpandedTokenVector* tokens;
+    MacroInvocation* invocation;
+
+    // where the last finished operand starts in tokens
+    size_t operand_start;
+
+    // Set by `##` until the next operand writes its first token.
+    // paste_start is where the left operand starts, an empty
+    // left operand (a placemarker) leaves nothing to paste onto.
+    bool is_pasting;
+    size_t paste_start;
+} Substitution;
+
+// returns where the operand about to be written starts
+static size_t substitution_begin(Substitution* sub) {
+    return sub->is_pasting ? sub->paste_start : sub->tokens->count;
+}
 
-    // branch depending on whether we expect va_args
-    if (!def->is_variadic) {
-        if (!pptoken_is(stream_peekahead(stream, 0), PP_PUNCTUATOR, ")")) {
-            panic("expected `)`");
-        }
+static void substitution_end(Substitution* sub, size_t operand_start) {
+    sub->operand_start = operand_start;
+    sub->is_pasting = false;
+}
 
-        stream_consume(stream, 1);
-        invoc->arguments = args;
-        invoc->are_va_args_present = false;
-        return;
+/*
+Whitespace is never pasted. Around `##` it only remains where a
+__VA_OPT__ group had an empty operand at its edge, so it stands
+next to a placemarker, which leaves the other side as it is.
+*/
+static void substitution_write(Substitution* sub, ExpandedToken* token) {
+    ExpandedTokenVector* tokens = sub->tokens;
+
+    if (sub->is_pasting && tokens->count > sub->paste_start &&
+        !is_whitespace_kind(token->kind) && !is_whitespace_kind(tokens->data[tokens->count - 1]->kind)) {
+        tokens->data[tokens->count - 1] = paste_tokens(tokens->data[tokens->count - 1], token, sub->invocation);
     }
 
     else {
-        if (pptoken_is(stream_peekahead(stream, 0), PP_PUNCTUATOR, ",")) {
-            stream_consume(stream, 1);
+        vector_push(tokens, token);
+    }
 
-            PPTokenVector* va_args = record_va_args(stream);
-            vector_push(args, va_args);
-            invoc->are_va_args_present = true;
-        }
+    sub->is_pasting = false;
+}
 
-        // Expect a `)`
-        if (!pptoken_is(stream_peekahead(stream, 0), PP_PUNCTUATOR, ")")) {
-            panic("expected `)`");
+/*
+Writes an argument. One that is an operand of `##` goes in as it
+was written, without its surrounding whitespace, any other one is
+fully macro-expanded first.
+*/
+static void substitution_write_argument(Substitution* sub, size_t index, bool is_pasted) {
+    size_t operand_start = substitution_begin(sub);
+
+    if (is_pasted) {
+        ExpandedTokenVector* arg = sub->invocation->arguments->data[index];
+
+        size_t first, end;
+        trim_argument(arg, &first, &end);
+
+        for (size_t i = first; i < end; ++i) {
+            substitution_write(sub, arg->data[i]);
         }
+    }
 
-        stream_consume(stream, 1);
-        invoc->arguments = args;
-        return;
+    else if (!sub->is_pasting) {
+        vector_append(sub->tokens, get_expanded_argument(sub->invocation, index));
     }
-}
 
-static ssize_t params_contains(PPTokenVector* params, PPToken* param) {
-    for (ssize_t i = 0; i < (ssize_t)params->count; ++i) {
-        if (pptoken_is(params->data[i], PP_IDENTIFIER, param->spelling)) {
-            return i;
+    else {
+        ExpandedTokenVector* arg = get_expanded_argument(sub->invocation, index);
+
+        for (size_t i = 0; i < arg->count; ++i) {
+            substitution_write(sub, arg->data[i]);
         }
     }
 
-    return -1;
+    substitution_end(sub, operand_start);
 }
 
-static PPTokenVector* record_va_opt_tokens(PPTokenStream* stream) {
-    stream_consume(stream, 1);  // eat __VA_OPT__
-    stream_skip_whitespace(stream);
+static ExpandedTokenVector* replace_params(MacroInvocation* invoc, HideSet* hide_set) {
+    MacroDefinition* def = invoc->definition;
+    ExpandedTokenVectorVector* args = invoc->arguments;
+    MacroOpVector* body = def->body;
+
+    Substitution sub = {
+        .tokens = ARENA_ALLOC(ExpandedTokenVector, 1),
+        .invocation = invoc,
+        .operand_start = 0,
+        .is_pasting = false,
+        .paste_start = 0,
+    };
 
-    if (!pptoken_is(stream_peekahead(stream, 0), PP_PUNCTUATOR, "(")) {
-        panic("expected `(`");
-    }
+    // where the __VA_OPT__ group being written starts
+    size_t va_opt_start = 0;
 
-    stream_consume(stream, 1);
+    // for a group spelled by `#`: its first op, where its own tokens start,
+    // and whether a `##` was waiting for the string literal it becomes
+    MacroOp* va_opt_begin = nullptr;
+    size_t va_opt_group_start = 0;
+    bool va_opt_was_pasting = false;
 
-    PPTokenVector* va_opt_tokens = ARENA_ALLOC(PPTokenVector, 1);
+    for (size_t i = 0; i < body->count; ++i) {
+        MacroOp* op = &body->data[i];
 
-    size_t paren_depth = 0;
-    while (true) {
-        PPToken* token = stream_peekahead(stream, 0);
+        bool is_pasted = (i > 0 && body->data[i - 1].kind == MACRO_OP_PASTE) ||
+                         (i + 1 < body->count && body->data[i + 1].kind == MACRO_OP_PASTE);
 
-        if (token->kind == PP_EOF) {
-            panic("expected `)`");
-        }
+        switch (op->kind) {
+            case MACRO_OP_LITERAL: {
+                size_t operand_start = substitution_begin(&sub);
+                substitution_write(&sub, expanded_token_create(op->token, invoc, hide_set));
+                substitution_end(&sub, operand_start);
+                break;
+            }
 
-        else if (pptoken_is(token, PP_PUNCTUATOR, ")") && paren_depth == 0) {
-            stream_consume(stream, 1);
-            break;
-        }
+            case MACRO_OP_PARAM:
+                substitution_write_argument(&sub, op->operand, is_pasted);
+                break;
 
-        else if (pptoken_is(token, PP_PUNCTUATOR, ")") && paren_depth > 0) {
-            paren_depth--;
-            vector_push(va_opt_tokens, token);
-            stream_consume(stream, 1);
-            continue;
-        }
+            case MACRO_OP_VA_ARGS:
+                if (invoc->are_va_args_present) {
+                    substitution_write_argument(&sub, args->count - 1, is_pasted);
+                }
 
-        else if (pptoken_is(token, PP_PUNCTUATOR, "(")) {
-            paren_depth++;
-            vector_push(va_opt_tokens, token);
-            stream_consume(stream, 1);
-            continue;
-        }
+                else {
+                    substitution_end(&sub, substitution_begin(&sub));
+                }
+                break;
 
-        else {
-            vector_push(va_opt_tokens, token);
-            stream_consume(stream, 1);
-            continue;
+            case MACRO_OP_STRINGIZE: {
+                size_t operand_start = substitution_begin(&sub);
+                substitution_write(&sub, stringize(op, args->data[op->operand], invoc, hide_set));
+                substitution_end(&sub, operand_start);
+                break;
+            }
+
+            case MACRO_OP_PASTE:
+                sub.is_pasting = true;
+                sub.paste_start = sub.operand_start;
+                break;
+
+            case MACRO_OP_VA_OPT_BEGIN:
+                // The whole group is one operand. Without variable
+                // arguments jump to the matching end, the loop steps past it.
+                if (body->data[op->operand].operand) {
+                    // a stringized group is written on its own and spelled at its end
+                    va_opt_begin = op;
+                    va_opt_was_pasting = sub.is_pasting;
+                    sub.is_pasting = false;
+                    va_opt_group_start = sub.tokens->count;
+
+                    if (!are_expanded_va_args_present(invoc)) {
+                        i = op->operand - 1;
+                    }
+                    break;
+                }
+
+                va_opt_start = substitution_begin(&sub);
+
+                if (!are_expanded_va_args_present(invoc)) {
+                    i = op->operand;
+                    substitution_end(&sub, va_opt_start);
+                }
+                break;
+
+            case MACRO_OP_VA_OPT_END:
+                if (op->operand) {
+                    ExpandedTokenVector group = {
+                        .data = sub.tokens->data + va_opt_group_start,
+                        .count = sub.tokens->count - va_opt_group_start,
+                        .capacity = sub.tokens->count - va_opt_group_start,
+                    };
+                    ExpandedToken* string = stringize(va_opt_begin, &group, invoc, hide_set);
+
+                    sub.tokens->count = va_opt_group_start;
+                    sub.is_pasting = va_opt_was_pasting;
+
+                    va_opt_start = substitution_begin(&sub);
+                    substitution_write(&sub, string);
+                }
+
+                substitution_end(&sub, va_opt_start);
+                break;
         }
     }
 
-    return va_opt_tokens;
+    return sub.tokens;
 }
 
-static PPTokenVector* replace_params(MacroInvocation* invoc) {
-    MacroDefinition* def = invoc->definition;
-    PPTokenVectorVector* args = invoc->arguments;
+/*
+The same call as `call`, but made within invoc where `call` was made
+within recorded. Returns `call` itself if it was not made within
+recorded, as for the tokens of the arguments.
+*/
+static MacroInvocation* invocation_restamp(MacroInvocation* call, MacroInvocation* recorded, MacroInvocation* invoc) {
+    MacroInvocation* outer = call;
+    while (outer != nullptr && outer != recorded) {
+        outer = outer->parent;
+    }
+
+    if (outer == nullptr) {
+        return call;
+    }
 
-    PPTokenVector* template = def->replacement_list;
-    PPTokenVector* params = def->params;
+    // copies the links below recorded, then hangs them from invoc
+    MacroInvocation* head = nullptr;
+    MacroInvocation** link = &head;
 
-    PPTokenVector* new_pptokens = ARENA_ALLOC(PPTokenVector, 1);
+    for (outer = call; outer != recorded; outer = outer->parent) {
+        MacroInvocation* copy = ARENA_ALLOC(MacroInvocation, 1);
+        *copy = *outer;
 
-    PPTokenStream stream = {
-        .pptokens = template,
-        .current_index = 0,
-    };
+        *link = copy;
+        link = &copy->parent;
+    }
 
-    while (true) {
-        PPToken* template_token = stream_peekahead(&stream, 0);
+    *link = invoc;
+    return head;
+}
 
-        if (template_token->kind == PP_EOF) {
-            break;
+/*
+The memoized expansion as invoc makes it: the tokens the recorded
+call made are stamped with invoc instead, so that errors and
+expansion traces name the call being replayed.
+*/
+static ExpandedTokenVector* memo_replay(MemoEntry* entry, MacroInvocation* invoc) {
+    ExpandedTokenVector* recorded = entry->expansion;
+
+    ExpandedTokenVector* expansion = ARENA_ALLOC(ExpandedTokenVector, 1);
+    vector_reserve(expansion, recorded->count);
+
+    // consecutive tokens mostly come from the same call
+    MacroInvocation* last_call = nullptr;
+    MacroInvocation* last_restamped = nullptr;
+
+    for (size_t i = 0; i < recorded->count; ++i) {
+        ExpandedToken* token = recorded->data[i];
+
+        if (token->invocation != last_call) {
+            last_call = token->invocation;
+            last_restamped = invocation_restamp(last_call, entry->invocation, invoc);
         }
 
-        if (template_token->kind != PP_IDENTIFIER) {
-            vector_push(new_pptokens, template_token);
-            stream_consume(&stream, 1);
-            continue;
+        if (last_restamped != token->invocation) {
+            ExpandedToken* copy = ARENA_ALLOC(ExpandedToken, 1);
+            *copy = *token;
+            copy->invocation = last_restamped;
+            token = copy;
         }
 
-        // now we know it IS an identifier
-        if (pptoken_is(template_token, PP_IDENTIFIER, "__VA_ARGS__")) {
-            if (!def->is_variadic) {
-                panic("__VA_ARGS__ inside nonvariadic macro");
-            }
+        vector_push(expansion, token);
+    }
 
-            stream_consume(&stream, 1);
-            if (invoc->are_va_args_present) {
-                vector_append(new_pptokens, args->data[args->count - 1]);
-            }
+    return expansion;
+}
 
-            else {
-                continue;
-            }
-        }
+/*
+Pushes the expansion of invoc for rescanning. A memoized one is
+replayed as invoc makes it, else the substituted body, recording the
+expansion if nothing else is being recorded.
+*/
+static void expander_push_expansion(Expander* ex, MacroInvocation* invoc, HideSet* hide_set) {
+    MacroDefinition* def = invoc->definition;
+    u64 fingerprint = memo_fingerprint(def, hide_set, invoc->arguments);
 
-        else if (pptoken_is(template_token, PP_IDENTIFIER, "__VA_OPT__")) {
-            if (!def->is_variadic) {
-                panic("__VA_OPT__ inside nonvariadic macro");
-            }
+    MemoEntry* entry = memo_find(def, hide_set, invoc->arguments, fingerprint);
+    if (entry != nullptr) {
+        // an expansion being recorded now depends on what this one did
+        if (g_memo.recording != nullptr) {
+            MacroDependencySet* dependencies = &entry->dependencies;
 
-            PPTokenVector* va_opt_tokens = record_va_opt_tokens(&stream);
-            if (invoc->are_va_args_present) {
-                vector_append(new_pptokens, va_opt_tokens);
-            }
+            for (size_t i = 0; i < dependencies->capacity; ++i) {
+                MacroDependency* slot = &dependencies->slots[i];
 
-            else {
-                continue;
+                if (slot->name != nullptr) {
+                    dependency_set_add(&g_memo.recording->dependencies, slot->name, slot->definition);
+                }
             }
         }
 
-        else {
-            ssize_t param_index = params_contains(params, template_token);
+        expander_push_frame(ex, memo_replay(entry, invoc), nullptr)->is_expanded = true;
+        return;
+    }
 
-            if (param_index == -1) {
-                // not a param, push it
-                vector_push(new_pptokens, template_token);
-                stream_consume(&stream, 1);
-                continue;
-            }
+    ExpandedTokenVector* tokens = replace_params(invoc, hide_set);
+    MemoEntry* recording = nullptr;
 
-            PPTokenVector* arg = args->data[param_index];
-            vector_append(new_pptokens, arg);
-            stream_consume(&stream, 1);
-        }
+    if (g_memo.recording == nullptr) {
+        recording = memo_begin(ex, invoc, hide_set, fingerprint);
     }
 
-    return new_pptokens;
+    expander_push_frame(ex, tokens, hide_set)->recording = recording;
 }
 
-static ExpandedTokenVector* expand_function_like_macro(MacroDefinition* def, PPTokenStream* stream) {
-    PPToken* macro_name_token = stream_peekahead(stream, 0);
-    stream_consume(stream, 1);
+/*
+Returns false if the name of a function-like macro
+is not followed by `(`, which is no invocation at all.
+*/
+static bool expand_function_like_macro(Expander* ex, MacroDefinition* def, ExpandedToken* macro_name_token) {
+    if (!expander_is_lparen_next(ex)) {
+        return false;
+    }
+
+    // drop everything up to and including the `(`
+    while (!expanded_token_is(expander_read(ex), PP_PUNCTUATOR, "("));
 
     MacroInvocation* invoc = ARENA_ALLOC(MacroInvocation, 1);
     invoc->definition = def;
-    invoc->origin = macro_name_token;
+    invoc->origin = macro_name_token->origin;
+    invoc->parent = macro_name_token->invocation;
 
-    stream_skip_whitespace_and_newline(stream);
+    HideSet* rparen_hide_set = record_args(ex, invoc);
 
-    if (!pptoken_is(stream_peekahead(stream, 0), PP_PUNCTUATOR, "(")) {
-        panic("expected `(`");
+    // (HS ∩ HS') ∪ {T}
+    HideSet* hide_set = hideset_intersection(macro_name_token->hide_set, rparen_hide_set);
+    hide_set = hideset_add(hide_set, def->id);
+
+    // rescan together with the rest of the input
+    expander_push_expansion(ex, invoc, hide_set);
+    return true;
+}
+
+static bool expand_object_like_macro(Expander* ex, MacroDefinition* def, ExpandedToken* macro_name_token) {
+    MacroInvocation* invoc = ARENA_ALLOC(MacroInvocation, 1);
+    invoc->definition = def;
+    invoc->origin = macro_name_token->origin;
+    invoc->parent = macro_name_token->invocation;
+
+    // HS ∪ {T}
+    HideSet* hide_set = hideset_add(macro_name_token->hide_set, def->id);
+
+    // rescan together with the rest of the input
+    expander_push_expansion(ex, invoc, hide_set);
+    return true;
+}
+
+static char* spell_unsigned(u64 value) {
+    char digits[21];
+    size_t start = sizeof(digits) - 1;
+    digits[start] = '\0';
+
+    do {
+        digits[--start] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+
+    return strdup(digits + start);
+}
+
+// the text as a string literal, C23 6.4.5
+static char* spell_string_literal(char* text) {
+    size_t length = 2;
+    for (char* c = text; *c != '\0'; ++c) {
+        length += *c == '\"' || *c == '\\' ? 2 : 1;
     }
 
-    record_args(invoc, stream);
+    char* spelling = ARENA_ALLOC(char, length + 1);
+    size_t i = 0;
+
+    spelling[i++] = '\"';
+    for (char* c = text; *c != '\0'; ++c) {
+        if (*c == '\"' || *c == '\\') {
+            spelling[i++] = '\\';
+        }
 
-    PPTokenVector* replacement_tokens = replace_params(invoc);
+        spelling[i++] = *c;
+    }
+    spelling[i++] = '\"';
 
-    // rescan
-    ExpandedTokenVector* expanded_tokens = expand(replacement_tokens);
+    spelling[i] = '\0';
+    return spelling;
+}
 
-    // Stamp the invocation instance
-    for (size_t i = 0; i < expanded_tokens->count; ++i) {
-        ExpandedToken* token = expanded_tokens->data[i];
-        if (token->invocation == nullptr) {
-            token->invocation = invoc;
+/*
+The line of byte, counted on from the last byte asked about.
+__LINE__ mostly moves forward through one file, so counting
+from the start of the file every time is rarely needed.
+*/
+static size_t line_of_byte(Byte* byte) {
+    static FileDefinition* file = nullptr;
+    static size_t offset = 0;
+    static size_t line = 1;
+
+    FileDefinition* byte_file = file_inclusion_resolve(byte->origin)->definition;
+
+    if (byte_file != file || byte->offset < offset) {
+        file = byte_file;
+        offset = 0;
+        line = 1;
+    }
+
+    u8* content = file_content(file);
+    for (; offset < byte->offset; ++offset) {
+        if (content[offset] == '\n') {
+            line++;
         }
     }
 
-    return expanded_tokens;
+    return line;
 }
 
-static ExpandedTokenVector* expand_object_like_macro(MacroDefinition* def, PPTokenStream* stream) {
-    PPToken* macro_name_token = stream_peekahead(stream, 0);
-    stream_consume(stream, 1);
+// "Mmm dd yyyy" for the day the translation started, C23 6.10.10.2
+static char* spell_date(void) {
+    static char* date = nullptr;
+    if (date != nullptr) {
+        return date;
+    }
+
+    static char* MONTHS[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+    // civil date from days since 1970-01-01, in eras of 400 years starting in March
+    s64 days = linux_time() / 86400 + 719468;
+    s64 era = days / 146097;
+    s64 day_of_era = days - era * 146097;
+    s64 year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    s64 day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    s64 month_index = (5 * day_of_year + 2) / 153;
+
+    u64 day = day_of_year - (153 * month_index + 2) / 5 + 1;
+    u64 month = month_index < 10 ? month_index + 3 : month_index - 9;
+    u64 year = year_of_era + era * 400 + (month <= 2);
 
+    char* text = strcat(MONTHS[month - 1], day < 10 ? "  " : " ");
+    text = strcat(text, spell_unsigned(day));
+    text = strcat(text, " ");
+    text = strcat(text, spell_unsigned(year));
+
+    date = spell_string_literal(text);
+    return date;
+}
+
+/*
+Predefined macros expand to a single token made up on the spot.
+__FILE__ and __LINE__ name where the outermost macro invocation
+around them was written, and are only worked out when used.
+*/
+static bool expand_predefined_macro(Expander* ex, MacroDefinition* def, ExpandedToken* macro_name_token) {
     MacroInvocation* invoc = ARENA_ALLOC(MacroInvocation, 1);
     invoc->definition = def;
-    invoc->origin = macro_name_token;
+    invoc->origin = macro_name_token->origin;
+    invoc->parent = macro_name_token->invocation;
+
+    PPToken* site = invoc->origin;
+    for (MacroInvocation* outer = invoc->parent; outer != nullptr; outer = outer->parent) {
+        site = outer->origin;
+    }
 
-    // rescan
-    ExpandedTokenVector* expanded_tokens = expand(def->replacement_list);
+    Byte* byte = pptoken_first_byte(site);
+    char* spelling = nullptr;
 
-    // Stamp the invocation instance
-    for (size_t i = 0; i < expanded_tokens->count; ++i) {
-        ExpandedToken* token = expanded_tokens->data[i];
-        if (token->invocation == nullptr) {
-            token->invocation = invoc;
-        }
+    switch (def->predefined) {
+        case PREDEFINED_CONSTANT:
+            spelling = ((PredefinedMacro*)def)->spelling;
+            break;
+
+        case PREDEFINED_FILE:
+            spelling = spell_string_literal(file_inclusion_resolve(byte->origin)->definition->full_path);
+            break;
+
+        case PREDEFINED_LINE:
+            spelling = spell_unsigned(line_of_byte(byte));
+            break;
+
+        case PREDEFINED_COUNTER:
+            spelling = spell_unsigned(g_expander_context.counter++);
+            break;
+
+        case PREDEFINED_DATE:
+            spelling = spell_date();
+            break;
+
+        case PREDEFINED_NONE:
+            break;
+    }
+
+    // what the expansion around this one comes to now depends on where and when
+    if (def->predefined != PREDEFINED_CONSTANT) {
+        memo_abandon();
     }
 
-    return expanded_tokens;
+    PPToken* pptoken = retokenize(spelling, spliced_char_resolve(macro_name_token->origin->origin.data[0]));
+
+    ExpandedTokenVector* tokens = ARENA_ALLOC(ExpandedTokenVector, 1);
+    ExpandedToken* token = expanded_token_create(pptoken, invoc, nullptr);
+    vector_push(tokens, token);
+
+    expander_push_frame(ex, tokens, nullptr)->is_expanded = true;
+    return true;
 }
 
-static ExpandedTokenVector* expand_macro(PPTokenStream* stream) {
-    PPToken* macro_name_token = stream_peekahead(stream, 0);
-    char* macro_name = macro_name_token->spelling;
-    MacroDefinition* def = is_defined(macro_name);
+static bool expand_macro(Expander* ex, MacroDefinition* def, ExpandedToken* macro_name_token) {
+    if (def->predefined != PREDEFINED_NONE) {
+        return expand_predefined_macro(ex, def, macro_name_token);
+    }
 
     if (def->is_function_like) {
-        return expand_function_like_macro(def, stream);
+        return expand_function_like_macro(ex, def, macro_name_token);
     }
 
     else {
-        return expand_object_like_macro(def, stream);
+        return expand_object_like_macro(ex, def, macro_name_token);
     }
 }
 
-ExpandedTokenVector* expand(PPTokenVector* pptokens) {
+/*
+Prosser's expansion algorithm, with the recursion replaced by
+the frame stack: a macro's substituted body is pushed as a frame
+and rescanned in place, so nesting depth costs no C stack.
+Returns the next fully expanded token, nullptr at the end.
+*/
+static ExpandedToken* expander_next(Expander* ex) {
+    while (true) {
+        // Nothing is pending here, so a recorded expansion that ran out is complete.
+        expander_pop_exhausted_frames(ex, FRAME_POP_SETTLED);
+
+        // Directives and conditionals only exist in the source itself.
+        PPTokenStream* stream = expander_source(ex);
+        if (stream != nullptr && ex->frames.count == 0) {
+            ConditionalState current_conditonal_state = conditional_stack_top(&g_expander_context.conditional_stack);
+
+            // Skipped lines are never lexed, only the directives among them.
+            if (current_conditonal_state != COND_ACTIVE) {
+                stream_skip_group(stream);
+            }
+
+            PPToken* pptoken = stream_peekahead(stream, 0);
+
+            // end of an included file, carry on in the includer
+            if (pptoken->kind == PP_EOF) {
+                ex->includes.count--;
+                continue;
+            }
+
+            // Directives must be checked even if we are skipping
+            // because it may be a conditional directive,
+            if (pptoken_is(pptoken, PP_PUNCTUATOR, "#") && stream_is_it_start_of_line(stream)) {
+                execute_directive(ex);
+                continue;
+            }
+
+            // If we are skipping, just skip and move on.
+            if (current_conditonal_state != COND_ACTIVE) {
+                stream_skip_line(stream);
+                continue;
+            }
+        }
+
+        bool is_rescanned = ex->frames.count == 0 || !ex->frames.data[ex->frames.count - 1].is_expanded;
+        ExpandedToken* token = expander_read(ex);
+
+        if (token == nullptr) {
+            return nullptr;
+        }
+
+        // Check if it is a macro invocation the hide set allows.
+        if (token->kind == PP_IDENTIFIER && is_rescanned) {
+            MacroDefinition* def = lookup_macro(token->spelling);
+
+            if (def != nullptr &&
+                !hideset_contains(token->hide_set, def->id) &&
+                expand_macro(ex, def, token)) {
+                continue;
+            }
+        }
+
+        if (g_memo.recording_expander == ex) {
+            vector_push(g_memo.recording->expansion, token);
+        }
+
+        // This is a normal token. Take it as it is.
+        return token;
+    }
+}
+
+PPContext* pp_create(char* full_path) {
+    PPContext* ctx = ARENA_ALLOC(PPContext, 1);
+
     PPTokenStream stream = {
-        .pptokens = pptokens,
+        .pptokens = ARENA_ALLOC(PPTokenVector, 1),
         .current_index = 0,
+        .lexer = lexer_create(full_path, nullptr),
     };
 
-    ExpandedTokenVector* expanded_tokens = ARENA_ALLOC(ExpandedTokenVector, 1);
+    vector_push(&ctx->expander.includes, stream);
+    return ctx;
+}
 
-    while (true) {
-        PPToken* pptoken = stream_peekahead(&stream, 0);
+ExpandedToken* pp_next_token(PPContext* ctx) {
+    return expander_next(&ctx->expander);
+}
+
+// runs directive lines that come from the command line rather than a file
+static void execute_command_line(char* directives) {
+    Expander ex = {
+        .includes = {0},
+        .frames = {0},
+    };
+
+    PPTokenStream stream = {
+        .pptokens = ARENA_ALLOC(PPTokenVector, 1),
+        .current_index = 0,
+        .lexer = lexer_create_from_inclusion(read_memory("<command line>", directives)),
+    };
+
+    vector_push(&ex.includes, stream);
 
-        if (pptoken->kind == PP_EOF) {
+    // nothing but directives, so nothing comes out
+    while (expander_next(&ex) != nullptr);
+}
+
+/*
+Like gcc and clang, a later -D of a name replaces an earlier one
+rather than being an incompatible redefinition, so the name is
+undefined first. Only #define in the source is held to C23 6.10.4.2.
+*/
+void pp_define(char* definition) {
+    char* name = strdup(definition);
+    for (char* c = name; *c != '\0'; ++c) {
+        if (*c == '=' || *c == '(') {
+            *c = '\0';
             break;
         }
+    }
 
-        // Directives must be checked even if we are skipping
-        // because it may be a conditional directive,
-        if (pptoken_is(pptoken, PP_PUNCTUATOR, "#") && stream_is_it_start_of_line(&stream)) {
-            ExpandedTokenVector* new_expanded_tokens = execute_directive(&stream);
-            vector_append(expanded_tokens, new_expanded_tokens);
-            continue;
-        }
+    char* directive = strcat("#define ", definition);
 
-        ConditionalState current_conditonal_state = conditional_stack_top(&g_expander_context.conditional_stack);
+    // -DNAME defines NAME as 1, -DNAME=VALUE as VALUE
+    char* equals = directive;
+    while (*equals != '\0' && *equals != '=') {
+        equals++;
+    }
 
-        // If we are skipping, just skip and move on.
-        if (current_conditonal_state == COND_SKIPPING) {
-            stream_skip_line(&stream);
-            continue;
-        }
+    if (*equals == '=') {
+        *equals = ' ';
+    }
 
-        // Check if it is a macro invocation.
-        if (pptoken->kind == PP_IDENTIFIER && is_defined(pptoken->spelling)) {
-            ExpandedTokenVector* new_expanded_tokens = expand_macro(&stream);
-            vector_append(expanded_tokens, new_expanded_tokens);
-            continue;
+    else {
+        directive = strcat(directive, " 1");
+    }
+
+    execute_command_line(strcat(strcat(strcat("#undef ", name), "\n"), strcat(directive, "\n")));
+}
+
+void pp_undefine(char* name) {
+    execute_command_line(strcat(strcat("#undef ", name), "\n"));
+}
+
+static void rope_push(ExpandedTokenRope* rope, ExpandedToken* token) {
+    if (rope->tail == nullptr || rope->tail->count == EXPANDED_TOKEN_BLOCK_SIZE) {
+        ExpandedTokenBlock* block = ARENA_ALLOC(ExpandedTokenBlock, 1);
+        block->count = 0;
+        block->next = nullptr;
+
+        if (rope->tail == nullptr) {
+            rope->head = block;
         }
 
-        // This is a normal pptoken. Take it as it is.
-        ExpandedToken* expanded_token = ARENA_ALLOC(ExpandedToken, 1);
-        expanded_token->kind = pptoken->kind;
-        expanded_token->spelling = strdup(pptoken->spelling);
-        expanded_token->length = pptoken->length;
-        expanded_token->origin = pptoken;
-        expanded_token->invocation = nullptr;
+        else {
+            rope->tail->next = block;
+        }
 
-        vector_push(expanded_tokens, expanded_token);
-        stream_consume(&stream, 1);
+        rope->tail = block;
     }
 
-    return expanded_tokens;
+    rope->tail->data[rope->tail->count++] = token;
+    rope->count++;
+}
+
+void expand(PPContext* ctx, ExpandedTokenRope* output) {
+    for (ExpandedToken* token = pp_next_token(ctx); token != nullptr; token = pp_next_token(ctx)) {
+        rope_push(output, token);
+    }
 }
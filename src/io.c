@@ -3,15 +3,148 @@
 #include <linux.h>
 #include <string.h>
 
+/*
+Output goes through one buffer per file descriptor and reaches
+the kernel when the buffer fills up, when it is flushed, and at
+exit. Descriptors past the table are written through directly.
+
+A flush is a single writev of everything pending in order: runs
+of bytes copied into the buffer, and borrowed spans of memory that
+is known to outlive the flush, such as the contents of the source
+files, which are never copied at all.
+*/
+#define IO_BUFFER_SIZE (1 << 16)
+#define IO_BUFFERED_FDS 8
+
+typedef struct IOBuffer {
+    char data[IO_BUFFER_SIZE];
+    size_t count;
+
+    linux_iovec_t iovs[LINUX_IOV_MAX];
+    size_t iov_count;
+} IOBuffer;
+
+static IOBuffer g_io_buffers[IO_BUFFERED_FDS];
+
+static void write_all(s32 fd, char* buf, size_t len) {
+    while (len > 0) {
+        s64 written = linux_write(fd, buf, len);
+        if (written <= 0) {
+            return;
+        }
+
+        buf += written;
+        len -= written;
+    }
+}
+
+static void writev_all(s32 fd, linux_iovec_t* iovs, size_t iov_count) {
+    while (iov_count > 0) {
+        s64 written = linux_writev(fd, iovs, iov_count);
+        if (written <= 0) {
+            return;
+        }
+
+        // skip what went out, a partly written iovec is resumed
+        while (iov_count > 0 && (size_t)written >= iovs->iov_len) {
+            written -= iovs->iov_len;
+            iovs++;
+            iov_count--;
+        }
+
+        if (iov_count > 0) {
+            iovs->iov_base = (char*)iovs->iov_base + written;
+            iovs->iov_len -= written;
+        }
+    }
+}
+
+static IOBuffer* io_buffer(s32 fd) {
+    if (fd < 0 || fd >= IO_BUFFERED_FDS) {
+        return nullptr;
+    }
+
+    return &g_io_buffers[fd];
+}
+
+// there must be room for one more iovec
+static void io_append(IOBuffer* buffer, char* base, size_t len) {
+    if (buffer->iov_count > 0) {
+        linux_iovec_t* last = &buffer->iovs[buffer->iov_count - 1];
+
+        if ((char*)last->iov_base + last->iov_len == base) {
+            last->iov_len += len;
+            return;
+        }
+    }
+
+    linux_iovec_t iov = {
+        .iov_base = base,
+        .iov_len = len,
+    };
+
+    buffer->iovs[buffer->iov_count++] = iov;
+}
+
+void io_flush(s32 fd) {
+    IOBuffer* buffer = io_buffer(fd);
+    if (buffer == nullptr || buffer->iov_count == 0) {
+        return;
+    }
+
+    writev_all(fd, buffer->iovs, buffer->iov_count);
+    buffer->count = 0;
+    buffer->iov_count = 0;
+}
+
+void io_flush_all(void) {
+    for (s32 fd = 0; fd < IO_BUFFERED_FDS; ++fd) {
+        io_flush(fd);
+    }
+}
+
+void io_write(s32 fd, char* buf, size_t len) {
+    IOBuffer* buffer = io_buffer(fd);
+    if (buffer == nullptr) {
+        write_all(fd, buf, len);
+        return;
+    }
+
+    if (buffer->count + len > IO_BUFFER_SIZE || buffer->iov_count == LINUX_IOV_MAX) {
+        io_flush(fd);
+
+        // too big to be worth the copy
+        if (len >= IO_BUFFER_SIZE) {
+            write_all(fd, buf, len);
+            return;
+        }
+    }
+
+    memcpy(buffer->data + buffer->count, buf, len);
+    io_append(buffer, buffer->data + buffer->count, len);
+    buffer->count += len;
+}
+
+void io_write_borrowed(s32 fd, char* buf, size_t len) {
+    IOBuffer* buffer = io_buffer(fd);
+    if (buffer == nullptr) {
+        write_all(fd, buf, len);
+        return;
+    }
+
+    if (buffer->iov_count == LINUX_IOV_MAX) {
+        io_flush(fd);
+    }
+
+    io_append(buffer, buf, len);
+}
+
 static void print_char(s32 fd, char c) {
-    linux_write(fd, &c, 1);
+    io_write(fd, &c, 1);
 }
 
 static void print_string(s32 fd, char* cstr) {
-    while (*(cstr) != '\0') {
-        print_char(fd, *cstr);
-        cstr++;
-    }
+    io_write(fd, cstr, strlen(cstr));
 }
 
 static void print_u64(s32 fd, u64 num, u64 base) {
@@ -60,6 +193,12 @@ void __fprintf_impl(
     (void)r8;
     (void)r9;
 
+    // Diagnostics come out in order with the output before them,
+    // and each one as soon as it is complete.
+    if (fd == LINUX_FD_STDERR) {
+        io_flush_all();
+    }
+
     va_list ap;
     va_start(ap, format);
 
@@ -122,4 +261,73 @@ void __fprintf_impl(
     }
 
     va_end(ap);
+
+    if (fd == LINUX_FD_STDERR) {
+        io_flush(fd);
+    }
+}
+
+/*
+The text of every byte value followed by a comma, padded to four
+bytes so that each one is written with a single unaligned store.
+*/
+typedef struct ByteText {
+    u32 text;
+    u32 length;
+} ByteText;
+
+static ByteText g_byte_texts[256];
+
+static void init_byte_texts(void) {
+    for (u32 value = 0; value < 256; ++value) {
+        char text[4] = {0};
+        u32 length = 0;
+
+        if (value >= 100) text[length++] = '0' + value / 100;
+        if (value >= 10) text[length++] = '0' + value / 10 % 10;
+        text[length++] = '0' + value % 10;
+        text[length++] = ',';
+
+        g_byte_texts[value].text = *(u32*)text;
+        g_byte_texts[value].length = length;
+    }
+}
+
+// written straight into the output buffer
+void print_byte_list(s32 fd, u8* bytes, size_t count) {
+    if (g_byte_texts[0].length == 0) {
+        init_byte_texts();
+    }
+
+    IOBuffer* buffer = io_buffer(fd);
+    if (buffer == nullptr || count == 0) {
+        for (size_t i = 0; i < count; ++i) {
+            fprintf(fd, i + 1 < count ? "%zu," : "%zu", (u64)bytes[i]);
+        }
+        return;
+    }
+
+    size_t i = 0;
+    while (i < count) {
+        if (buffer->count + 4 > IO_BUFFER_SIZE || buffer->iov_count == LINUX_IOV_MAX) {
+            io_flush(fd);
+        }
+
+        size_t start = buffer->count;
+        size_t end = start;
+
+        for (; i < count && end + 4 <= IO_BUFFER_SIZE; ++i) {
+            ByteText text = g_byte_texts[bytes[i]];
+            *(u32*)(buffer->data + end) = text.text;
+            end += text.length;
+        }
+
+        // no comma after the last one
+        if (i == count) {
+            end--;
+        }
+
+        io_append(buffer, buffer->data + start, end - start);
+        buffer->count = end;
+    }
 }
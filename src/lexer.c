@@ -0,0 +1,297 @@
+#include <arena.h>
+#include <lexer.h>
+#include <normalizer.h>
+#include <reader.h>
+#include <splicer.h>
+#include <string.h>
+#include <unicode.h>
+#include <vector.h>
+
+/*
+The scanners below work on the raw bytes of the file. They only
+have to find where logical lines end and where directives start,
+so they look at nothing but newlines, backslashes, comments and
+quotes, and leave jumping over everything else to memchr_any.
+*/
+
+// first index from i on that holds a newline, backslash, slash or quote
+static size_t find_special_byte(u8* content, size_t size, size_t i) {
+    if (i >= size) {
+        return i;
+    }
+
+    u8* found = memchr_any(content + i, "\n\\/\"\'", size - i);
+    return found == nullptr ? size : (size_t)(found - content);
+}
+
+static size_t find_byte(u8* content, size_t size, size_t i, u8 byte) {
+    if (i >= size) {
+        return i;
+    }
+
+    u8* found = memchr(content + i, byte, size - i);
+    return found == nullptr ? size : (size_t)(found - content);
+}
+
+static bool is_identifier_byte(u8 byte) {
+    return is_digit(byte) || is_nondigit(byte) || byte >= 0x80;
+}
+
+// i points just past `/*`, returns the index just past `*/`
+static size_t skip_block_comment(u8* content, size_t size, size_t i) {
+    while (true) {
+        i = find_byte(content, size, i, '*');
+
+        if (i >= size) {
+            return size;
+        }
+
+        if (content[i + 1] == '/') {
+            return i + 2;
+        }
+
+        i++;
+    }
+}
+
+// i points just past `//`, returns the index of the newline ending it
+static size_t skip_line_comment(u8* content, size_t size, size_t i) {
+    while (true) {
+        i = find_special_byte(content, size, i);
+
+        if (i >= size || content[i] == '\n') {
+            return i;
+        }
+
+        // a backslash splices the newline into the comment
+        i += content[i] == '\\' ? 2 : 1;
+    }
+}
+
+// i points at the opening quote, returns the index just past the closing one
+static size_t skip_quoted(u8* content, size_t size, size_t i) {
+    u8 quote = content[i];
+    i++;
+
+    while (i < size) {
+        u8 byte = content[i];
+
+        if (byte == quote) {
+            return i + 1;
+        }
+
+        // unterminated, which the tokenizer reports if it matters
+        if (byte == '\n') {
+            return i;
+        }
+
+        i += byte == '\\' ? 2 : 1;
+    }
+
+    return size;
+}
+
+// true for the quote in 1'000, false for the one in u8'a'
+static bool is_digit_separator(u8* content, size_t line_start, size_t i) {
+    size_t start = i;
+    while (start > line_start &&
+           (is_identifier_byte(content[start - 1]) || content[start - 1] == '.' || content[start - 1] == '\'')) {
+        start--;
+    }
+
+    if (start == i) {
+        return false;
+    }
+
+    return is_digit(content[start]) || (content[start] == '.' && is_digit(content[start + 1]));
+}
+
+/*
+Returns the index just past the newline that ends the logical
+line starting at line_start. Backslash-newlines and block comments
+carry a logical line over several physical ones.
+*/
+static size_t find_line_end(u8* content, size_t size, size_t line_start) {
+    size_t i = line_start;
+
+    while (true) {
+        i = find_special_byte(content, size, i);
+
+        if (i >= size) {
+            return size;
+        }
+
+        switch (content[i]) {
+            case '\n':
+                return i + 1;
+
+            case '\\':
+                i += 2;
+                break;
+
+            case '/':
+                if (content[i + 1] == '*') {
+                    i = skip_block_comment(content, size, i + 2);
+                }
+
+                else if (content[i + 1] == '/') {
+                    i = skip_line_comment(content, size, i + 2);
+                }
+
+                else {
+                    i++;
+                }
+                break;
+
+            case '\'':
+                if (is_digit_separator(content, line_start, i)) {
+                    i++;
+                    break;
+                }
+
+                i = skip_quoted(content, size, i);
+                break;
+
+            case '\"':
+                i = skip_quoted(content, size, i);
+                break;
+        }
+    }
+}
+
+// skips whitespace, block comments and backslash-newlines within a line
+static size_t skip_inline_whitespace(u8* content, size_t size, size_t i) {
+    while (i < size) {
+        if (is_inline_whitespace(content[i])) {
+            i++;
+        }
+
+        else if (content[i] == '/' && content[i + 1] == '*') {
+            i = skip_block_comment(content, size, i + 2);
+        }
+
+        else if (content[i] == '\\' && content[i + 1] == '\n') {
+            i += 2;
+        }
+
+        else {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/*
+Lexes just enough of the line to tell whether it is one of the
+conditional directives, which are the only lines a skipped group
+cannot do without.
+*/
+static bool is_conditional_directive(u8* content, size_t size, size_t i) {
+    i = skip_inline_whitespace(content, size, i);
+
+    if (content[i] == '#') {
+        i += 1;
+    }
+
+    else if (content[i] == '%' && content[i + 1] == ':') {
+        i += 2;
+    }
+
+    else {
+        return false;
+    }
+
+    i = skip_inline_whitespace(content, size, i);
+
+    // no conditional directive name is longer than 8 bytes
+    char name[9];
+    size_t length = 0;
+    while (i < size && is_identifier_byte(content[i])) {
+        if (length == 8) {
+            return false;
+        }
+
+        name[length++] = content[i++];
+    }
+    name[length] = '\0';
+
+    return streq(name, "if") || streq(name, "ifdef") || streq(name, "ifndef") ||
+           streq(name, "elif") || streq(name, "elifdef") || streq(name, "elifndef") ||
+           streq(name, "else") || streq(name, "endif");
+}
+
+/*
+The vectors the stages hand each other for a line are dead once its
+tokens are appended, so they go into an arena that is rewound after
+every line. Only the characters and tokens they point at are kept.
+*/
+static Arena g_line_arena = {0};
+
+Lexer* lexer_create(char* full_path, PPToken* inclusion_trigger) {
+    return lexer_create_from_inclusion(read(full_path, inclusion_trigger));
+}
+
+Lexer* lexer_create_from_inclusion(FileInclusion* inclusion) {
+    Lexer* lexer = ARENA_ALLOC(Lexer, 1);
+    lexer->inclusion = inclusion;
+    lexer->offset = 0;
+
+    file_acquire(inclusion->definition);
+
+    return lexer;
+}
+
+/*
+Appends the tokens of the next logical line to pptokens.
+Returns false once the whole file has been lexed.
+*/
+bool lexer_lex_line(Lexer* lexer, PPTokenVector* pptokens) {
+    FileDefinition* definition = lexer->inclusion->definition;
+
+    if (lexer->offset >= definition->size) {
+        if (!lexer->is_finished) {
+            lexer->is_finished = true;
+            file_release(definition);
+        }
+
+        return false;
+    }
+
+    size_t line_end = find_line_end(definition->content, definition->size, lexer->offset);
+
+    // sized from the line, like tokenize does, as the buffer is emptied between lines
+    size_t line_size = line_end - lexer->offset;
+    vector_reserve(pptokens, pptokens->count + line_size / TOKENIZER_BYTES_PER_TOKEN + 1);
+
+    ArenaMark mark = arena_mark(&g_line_arena);
+
+    ByteVector* bytes = read_bytes(lexer->inclusion, lexer->offset, line_end, &g_line_arena);
+    SourceCharVector* source_chars = normalize(bytes, &g_line_arena);
+    SplicedCharVector* spliced_chars = splice(source_chars, &g_line_arena);
+    PPTokenVector* line = tokenize(spliced_chars, &g_line_arena);
+
+    lexer->offset = line_end;
+
+    vector_append(pptokens, line);
+    arena_rewind(&g_line_arena, mark);
+    return true;
+}
+
+/*
+Skips the lines of a group whose condition is false without
+building any tokens for them, up to the next conditional directive
+or the end of the file. The directive itself is left to be lexed.
+*/
+void lexer_skip_group(Lexer* lexer) {
+    FileDefinition* definition = lexer->inclusion->definition;
+    u8* content = definition->content;
+    size_t size = definition->size;
+
+    size_t line_start = lexer->offset;
+    while (line_start < size && !is_conditional_directive(content, size, line_start)) {
+        line_start = find_line_end(content, size, line_start);
+    }
+
+    lexer->offset = line_start;
+}
@@ -1,14 +1,20 @@
 #include <linux.h>
 
 #define LINUX_SYSCALL_WRITE 1
+#define LINUX_SYSCALL_WRITEV 20
 #define LINUX_SYSCALL_EXIT 60
-#define LINUX_SYSCALL_BRK 12
 
 #define LINUX_SYSCALL_READ 0
 #define LINUX_SYSCALL_OPEN 2
 #define LINUX_SYSCALL_CLOSE 3
 #define LINUX_SYSCALL_FSTAT 5
 
+#define LINUX_SYSCALL_TIME 201
+#define LINUX_SYSCALL_MMAP 9
+#define LINUX_SYSCALL_MUNMAP 11
+#define LINUX_SYSCALL_MPROTECT 10
+#define LINUX_SYSCALL_MADVISE 28
+
 extern s64 _linux_syscall(
     s64 rdi,  // C puts it in: rdi
     s64 rsi,  // C puts it in: rsi
@@ -28,8 +34,8 @@ s64 linux_write(s32 fd, char* buf, size_t len) {
     return _linux_syscall((s64)fd, (s64)buf, (s64)len, 0, 0, 0, LINUX_SYSCALL_WRITE);
 }
 
-u8* linux_brk(u8* ptr) {
-    return (u8*)_linux_syscall((s64)ptr, 0, 0, 0, 0, 0, LINUX_SYSCALL_BRK);
+s64 linux_writev(s32 fd, linux_iovec_t* iov, s32 iovcnt) {
+    return _linux_syscall((s64)fd, (s64)iov, (s64)iovcnt, 0, 0, 0, LINUX_SYSCALL_WRITEV);
 }
 
 s32 linux_open(char* filename, s32 flags, s32 mode) {
@@ -62,3 +68,31 @@ s64 linux_read(s32 fd, u8* buf, size_t len) {
 s64 linux_fstat(s32 fd, linux_stat_t* stat) {
     return _linux_syscall((s64)fd, (s64)stat, 0, 0, 0, 0, LINUX_SYSCALL_FSTAT);
 }
+
+s64 linux_time(void) {
+    return _linux_syscall(0, 0, 0, 0, 0, 0, LINUX_SYSCALL_TIME);
+}
+
+u8* linux_mmap(u8* address, size_t length, s32 prot, s32 flags, s32 fd, s64 offset) {
+    return (u8*)_linux_syscall(
+        (s64)address,
+        (s64)length,
+        (s64)prot,
+        (s64)flags,
+        (s64)fd,
+        offset,
+        LINUX_SYSCALL_MMAP
+    );
+}
+
+s64 linux_munmap(u8* address, size_t length) {
+    return _linux_syscall((s64)address, (s64)length, 0, 0, 0, 0, LINUX_SYSCALL_MUNMAP);
+}
+
+s64 linux_mprotect(u8* address, size_t length, s32 prot) {
+    return _linux_syscall((s64)address, (s64)length, (s64)prot, 0, 0, 0, LINUX_SYSCALL_MPROTECT);
+}
+
+s64 linux_madvise(u8* address, size_t length, s32 advice) {
+    return _linux_syscall((s64)address, (s64)length, (s64)advice, 0, 0, 0, LINUX_SYSCALL_MADVISE);
+}
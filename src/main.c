@@ -4,21 +4,232 @@
 #include <linux.h>
 #include <main.h>
 #include <panic.h>
+#include <reader.h>
+#include <string.h>
 
-s32 main(s32 argc, char** argv) {
-    if (argc < 2) panic("no input file");
+// the argument of an option, either glued to it as in -DNAME or next as in -D NAME
+static char* option_argument(s32 argc, char** argv, s32* i) {
+    char* argument = argv[*i] + 2;
+
+    if (*argument == '\0') {
+        if (*i + 1 >= argc) {
+            panic("missing argument to `%s`", argv[*i]);
+        }
+
+        argument = argv[++*i];
+    }
+
+    return argument;
+}
+
+static bool has_prefix(char* string, char* prefix) {
+    for (; *prefix != '\0'; ++string, ++prefix) {
+        if (*string != *prefix) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// the MiB count of --memory-budget=N as bytes
+static size_t parse_budget(char* option) {
+    char* digits = option + strlen("--memory-budget=");
+    size_t mebibytes = 0;
+
+    if (*digits == '\0') {
+        panic("missing size in `%s`", option);
+    }
+
+    for (char* cursor = digits; *cursor != '\0'; ++cursor) {
+        if (*cursor < '0' || *cursor > '9') {
+            panic("invalid size in `%s`", option);
+        }
+
+        mebibytes = mebibytes * 10 + (size_t)(*cursor - '0');
+    }
+
+    return mebibytes << 20;
+}
+
+/*
+A token that appears directly in the source, spelled as it is
+there with no line splice inside, is written from the contents of
+its file rather than from its own copy. Runs of such tokens are
+contiguous in the file and go out as a single span.
+*/
+static void write_token(s32 fd, ExpandedToken* token) {
+    if (token->invocation == nullptr && token->origin != nullptr) {
+        Byte* start = pptoken_first_byte(token->origin);
+        Byte* end = pptoken_last_byte(token->origin);
+        FileInclusion* inclusion = file_inclusion_resolve(start->origin);
+
+        // a released file is not mapped again just to save a copy
+        if (inclusion != nullptr && inclusion->definition->content != nullptr &&
+            end->offset + 1 - start->offset == token->length) {
+            u8* content = inclusion->definition->content;
+            io_write_borrowed(fd, (char*)content + start->offset, token->length);
+            return;
+        }
+    }
+
+    io_write(fd, token->spelling, token->length);
+}
+
+static void write_output_token(s32 fd, ExpandedToken* token) {
+    if (token->kind == PP_EMBED) {
+        print_byte_list(fd, (u8*)token->spelling, token->length);
+    }
+
+    else {
+        write_token(fd, token);
+    }
+}
+
+/*
+State of the -P output, where every run of whitespace and comments
+between two tokens shrinks to a single space and blank lines are
+dropped. Only whether a token had whitespace before it survives.
+*/
+typedef struct CompactOutput {
+    bool pending_space;
+    bool pending_newline;
+    bool at_line_start;
+} CompactOutput;
+
+// a comment spanning several lines stands in for a newline rather than a space
+static bool is_multiline_comment(ExpandedToken* token) {
+    if (token->origin == nullptr || !token->origin->is_comment) {
+        return false;
+    }
+
+    for (size_t i = 0; i < token->length; ++i) {
+        if (token->spelling[i] == '\n') {
+            return true;
+        }
+    }
+
+    return false;
+}
 
+static void write_compact_token(s32 fd, CompactOutput* out, ExpandedToken* token) {
+    if (token->kind == PP_NEWLINE || is_multiline_comment(token)) {
+        out->pending_newline = true;
+        return;
+    }
+
+    if (token->kind == PP_WHITESPACE) {
+        out->pending_space = true;
+        return;
+    }
+
+    if (!out->at_line_start) {
+        if (out->pending_newline) {
+            io_write(fd, "\n", 1);
+        }
+
+        else if (out->pending_space) {
+            io_write(fd, " ", 1);
+        }
+    }
+
+    write_output_token(fd, token);
+
+    out->pending_space = false;
+    out->pending_newline = false;
+    out->at_line_start = false;
+}
+
+// how much memory the run took, written to stderr for --stats
+static void print_stats(void) {
+    size_t used = g_arena.position;
+    size_t unpacked = g_arena.unpacked_size;
+
+    eprintf("string kernels: %s\n", string_kernels_name());
+    eprintf("arena: %zu KiB used\n", used / 1024);
+    eprintf("arena: %zu KiB saved over rounding every allocation to 16 bytes\n",
+            unpacked > used ? (unpacked - used) / 1024 : 0);
+}
+
+s32 main(s32 argc, char** argv) {
+    string_init();
     arena_init();
 
-    ByteVector* bytes = read(argv[1], nullptr);
-    SourceCharVector* source_chars = normalize(bytes);
-    SplicedCharVector* spliced_chars = splice(source_chars);
-    PPTokenVector* pptokens = tokenize(spliced_chars);
-    ExpandedTokenVector* expanded_tokens = expand(pptokens);
+    char* input_path = nullptr;
+    char* output_path = nullptr;
+    bool compact = false;
+    bool stats = false;
+
+    // -D and -U take effect in the order they are given
+    for (s32 i = 1; i < argc; ++i) {
+        if (argv[i][0] == '-' && argv[i][1] == 'D') {
+            pp_define(option_argument(argc, argv, &i));
+        }
+
+        else if (argv[i][0] == '-' && argv[i][1] == 'U') {
+            pp_undefine(option_argument(argc, argv, &i));
+        }
+
+        else if (argv[i][0] == '-' && argv[i][1] == 'o') {
+            output_path = option_argument(argc, argv, &i);
+        }
+
+        else if (streq(argv[i], "-P")) {
+            compact = true;
+        }
+
+        else if (streq(argv[i], "--stats")) {
+            stats = true;
+        }
+
+        else if (streq(argv[i], "--low-memory")) {
+            reader_enable_low_memory();
+        }
+
+        else if (has_prefix(argv[i], "--memory-budget=")) {
+            arena_set_budget(parse_budget(argv[i]));
+        }
+
+        else if (input_path == nullptr) {
+            input_path = argv[i];
+        }
+
+        else {
+            panic("more than one input file");
+        }
+    }
+
+    if (input_path == nullptr) panic("no input file");
+
+    s32 output_fd = LINUX_FD_STDOUT;
+    if (output_path != nullptr) {
+        s32 flags = LINUX_FILE_FLAG_WRITEONLY | LINUX_FILE_FLAG_CREAT | LINUX_FILE_FLAG_TRUNC;
+        output_fd = linux_open(output_path, flags, LINUX_FILE_MODE_USER_RW);
+        if (output_fd < 0) panic("failed to open output file");
+    }
+
+    PPContext* pp = pp_create(input_path);
+
+    CompactOutput compact_output = {.at_line_start = true};
+
+    for (ExpandedToken* token = pp_next_token(pp); token != nullptr; token = pp_next_token(pp)) {
+        if (compact) {
+            write_compact_token(output_fd, &compact_output, token);
+        }
+
+        else {
+            write_output_token(output_fd, token);
+        }
+    }
+
+    if (compact && !compact_output.at_line_start) {
+        io_write(output_fd, "\n", 1);
+    }
 
-    for (size_t i = 0; i < expanded_tokens->count; ++i) {
-        printf("%s", expanded_tokens->data[i]->spelling);
+    if (stats) {
+        print_stats();
     }
 
+    io_flush_all();
     return LINUX_EXIT_SUCCESS;
 }
@@ -16,7 +16,7 @@ a dummy NUL Byte which lives on the static memory.
 static Byte* stream_peekahead(ByteStream* stream, size_t offset) {
     static Byte EOF_SENTINEL = {
         .value = 0,
-        .origin = nullptr,
+        .origin = {0},
         .offset = 0,
     };
 
@@ -51,8 +51,8 @@ static SourceChar* normalize_1byte_sequence(ByteStream* stream) {
 
     SourceChar* source_char = ARENA_ALLOC(SourceChar, 1);
     source_char->value = (b0 & 0x7f);
-    source_char->origin = ARENA_ALLOC(ByteVector, 1);
-    vector_push(source_char->origin, byte0);
+    small_vector_init(&source_char->origin);
+    vector_push(&source_char->origin, byte_handle(byte0));
 
     stream_consume(stream, 1);
 
@@ -71,9 +71,9 @@ static SourceChar* normalize_2byte_sequence(ByteStream* stream) {
 
     SourceChar* source_char = ARENA_ALLOC(SourceChar, 1);
     source_char->value = (((b0 & 0x1f) << 6) | (b1 & 0x3f));
-    source_char->origin = ARENA_ALLOC(ByteVector, 1);
-    vector_push(source_char->origin, byte0);
-    vector_push(source_char->origin, byte1);
+    small_vector_init(&source_char->origin);
+    vector_push(&source_char->origin, byte_handle(byte0));
+    vector_push(&source_char->origin, byte_handle(byte1));
 
     stream_consume(stream, 2);
 
@@ -94,10 +94,10 @@ static SourceChar* normalize_3byte_sequence(ByteStream* stream) {
 
     SourceChar* source_char = ARENA_ALLOC(SourceChar, 1);
     source_char->value = (((b0 & 0x0f) << 12) | ((b1 & 0x3f) << 6) | (b2 & 0x3f));
-    source_char->origin = ARENA_ALLOC(ByteVector, 1);
-    vector_push(source_char->origin, byte0);
-    vector_push(source_char->origin, byte1);
-    vector_push(source_char->origin, byte2);
+    small_vector_init(&source_char->origin);
+    vector_push(&source_char->origin, byte_handle(byte0));
+    vector_push(&source_char->origin, byte_handle(byte1));
+    vector_push(&source_char->origin, byte_handle(byte2));
 
     stream_consume(stream, 3);
 
@@ -120,24 +120,25 @@ static SourceChar* normalize_4byte_sequence(ByteStream* stream) {
 
     SourceChar* source_char = ARENA_ALLOC(SourceChar, 1);
     source_char->value = (((b0 & 0x07) << 18) | ((b1 & 0x3f) << 12) | ((b2 & 0x3f) << 6) | (b3 & 0x3f));
-    source_char->origin = ARENA_ALLOC(ByteVector, 1);
-    vector_push(source_char->origin, byte0);
-    vector_push(source_char->origin, byte1);
-    vector_push(source_char->origin, byte2);
-    vector_push(source_char->origin, byte3);
+    small_vector_init(&source_char->origin);
+    vector_push(&source_char->origin, byte_handle(byte0));
+    vector_push(&source_char->origin, byte_handle(byte1));
+    vector_push(&source_char->origin, byte_handle(byte2));
+    vector_push(&source_char->origin, byte_handle(byte3));
 
     stream_consume(stream, 4);
 
     return source_char;
 }
 
-SourceCharVector* normalize(ByteVector* bytes) {
+SourceCharVector* normalize(ByteVector* bytes, Arena* scratch) {
     ByteStream stream = {
         .bytes = bytes,
         .current_index = 0,
     };
 
-    SourceCharVector* source_chars = ARENA_ALLOC(SourceCharVector, 1);
+    SourceCharVector* source_chars = ARENA_ALLOC_IN(scratch, SourceCharVector, 1);
+    vector_reserve_in(scratch, source_chars, bytes->count);
 
     for (Byte* byte = stream_peekahead(&stream, 0);
          byte->value != 0;
@@ -165,7 +166,7 @@ SourceCharVector* normalize(ByteVector* bytes) {
             panic_byte(byte, "invalid UTF-8 detected");
         }
 
-        vector_push(source_chars, source_char);
+        vector_push_in(scratch, source_chars, source_char);
     }
 
     return source_chars;
@@ -2,21 +2,24 @@
 #include <io.h>
 #include <linux.h>
 #include <panic.h>
+#include <vector.h>
 
 Location byte_get_location(Byte* byte) {
+    FileDefinition* def = file_inclusion_resolve(byte->origin)->definition;
+    u8* content = file_content(def);
+
     Location loc = {
-        .filename = byte->origin->definition->full_path,
+        .filename = def->full_path,
         .line = 1,
         .col = 1,
     };
 
-    FileDefinition* def = byte->origin->definition;
     for (size_t i = 0; i < def->size; ++i) {
         if (i == byte->offset) {
             break;
         }
 
-        if (def->content[i] == '\n') {
+        if (content[i] == '\n') {
             loc.line++;
             loc.col = 1;
         }
@@ -63,21 +66,23 @@ void print_line(u8* line_start) {
 
         line_len++;
     }
-    linux_write(LINUX_FD_STDERR, (char*)line_start, line_len);
+    io_write(LINUX_FD_STDERR, (char*)line_start, line_len);
 }
 
 void print_snippet(FileDefinition* def, size_t line) {
     eprintf("  %zu | ", line);
 
+    u8* content = file_content(def);
+
     size_t current_line = 1;
     for (size_t i = 0; i < def->size; ++i) {
         if (current_line == line) {
-            print_line(def->content + i);
+            print_line(content + i);
             eprintf("\n");
             break;
         }
 
-        else if (def->content[i] == '\n') {
+        else if (content[i] == '\n') {
             current_line++;
             continue;
         }
@@ -104,16 +109,18 @@ void print_caret(size_t line, size_t col) {
     eprintf("^\n");
 }
 
+[[noreturn]] void panic_exit(void) {
+    io_flush_all();
+    linux_exit(LINUX_EXIT_FAILURE);
+}
+
 void print_include_trace(FileInclusion* inclusion) {
     if (inclusion->inclusion_trigger == nullptr) {
         return;
     }
 
-    PPToken* header_name_token = inclusion->inclusion_trigger;
-    SplicedChar* header_name_first_splicedchar = header_name_token->origin->data[0];
-    SourceChar* header_name_first_sourcechar = header_name_first_splicedchar->source_char;
-    Byte* header_name_first_byte = header_name_first_sourcechar->origin->data[0];
-    FileInclusion* parent_inclusion = header_name_first_byte->origin;
+    Byte* header_name_first_byte = pptoken_first_byte(inclusion->inclusion_trigger);
+    FileInclusion* parent_inclusion = file_inclusion_resolve(header_name_first_byte->origin);
 
     print_include_trace(parent_inclusion);
 
@@ -121,3 +128,28 @@ void print_include_trace(FileInclusion* inclusion) {
 
     eprintf("In file included from %s:%zu:\n", include_loc.filename, include_loc.line);
 }
+
+typedef struct MacroInvocationVector {
+    MacroInvocation** data;
+    size_t count;
+    size_t capacity;
+} MacroInvocationVector;
+
+/*
+Walks the parent links up to the call written in the source,
+then prints the chain outermost first. Iterative, because the
+chain is as long as the deepest macro nesting.
+*/
+void print_expansion_trace(MacroInvocation* invocation) {
+    MacroInvocationVector chain = {0};
+    for (; invocation != nullptr; invocation = invocation->parent) {
+        vector_push(&chain, invocation);
+    }
+
+    for (size_t i = chain.count; i > 0; --i) {
+        MacroInvocation* call = chain.data[i - 1];
+        Location loc = byte_get_location(pptoken_first_byte(call->origin));
+
+        eprintf("In expansion of macro `%s` from %s:%zu:%zu:\n", call->definition->name, loc.filename, loc.line, loc.col);
+    }
+}
@@ -6,6 +6,10 @@
 #include <string.h>
 #include <vector.h>
 
+#define READER_PAGE_SIZE 4096
+#define READER_PAGE_ALIGN_UP(number) \
+    (((number) + READER_PAGE_SIZE - 1) & ~(size_t)(READER_PAGE_SIZE - 1))
+
 typedef struct FileDefinitionMap {
     FileDefinition** data;
     size_t count;
@@ -13,6 +17,7 @@ typedef struct FileDefinitionMap {
 } FileDefinitionMap;
 
 static FileDefinitionMap g_file_definitions = {0};
+static bool g_low_memory = false;
 
 static FileDefinition* is_open(char* full_path) {
     for (size_t i = 0; i < g_file_definitions.count; ++i) {
@@ -25,6 +30,58 @@ static FileDefinition* is_open(char* full_path) {
     return nullptr;
 }
 
+static size_t mapping_length(FileDefinition* definition) {
+    return READER_PAGE_ALIGN_UP(definition->size + 1);
+}
+
+static void unmap_content(FileDefinition* definition) {
+    // the output may still be holding spans of the contents
+    io_flush_all();
+
+    linux_munmap(definition->content, mapping_length(definition));
+    arena_charge(-(s64)mapping_length(definition));
+    definition->content = nullptr;
+}
+
+// gives up the contents no lexer is using until length more bytes fit the budget
+static void reclaim_for(size_t length) {
+    for (size_t i = 0; i < g_file_definitions.count && !arena_budget_allows(length); ++i) {
+        FileDefinition* definition = g_file_definitions.data[i];
+
+        if (definition->content != nullptr && definition->readers == 0) {
+            unmap_content(definition);
+        }
+    }
+}
+
+/*
+The file mapped read-only. It lies at the start of a zeroed
+anonymous mapping one byte longer than the file, which provides
+the NUL after the last byte even when the file fills its last page.
+*/
+static void map_content(FileDefinition* definition) {
+    size_t length = mapping_length(definition);
+    reclaim_for(length);
+    arena_charge((s64)length);
+
+    s32 flags = LINUX_MAP_PRIVATE | LINUX_MAP_ANONYMOUS;
+    u8* content = linux_mmap(nullptr, length, LINUX_PROT_READ, flags, -1, 0);
+    if (LINUX_MMAP_FAILED(content)) panic("failed to map file");
+
+    if (definition->size > 0) {
+        s32 fd = linux_open(definition->full_path, LINUX_FILE_FLAG_READONLY, 0);
+        if (fd < 0) panic("failed to open file");
+
+        flags = LINUX_MAP_PRIVATE | LINUX_MAP_FIXED;
+        u8* file = linux_mmap(content, definition->size, LINUX_PROT_READ, flags, fd, 0);
+        if (file != content) panic("failed to map file");
+
+        linux_close(fd);
+    }
+
+    definition->content = content;
+}
+
 static FileDefinition* get_definition(char* full_path) {
     FileDefinition* definition = is_open(full_path);
 
@@ -32,6 +89,24 @@ static FileDefinition* get_definition(char* full_path) {
         return definition;
     }
 
+    else if (g_low_memory) {
+        s32 fd = linux_open(full_path, LINUX_FILE_FLAG_READONLY, 0);
+        if (fd < 0) panic("failed to open file");
+
+        linux_stat_t stat;
+        if (linux_fstat(fd, &stat) < 0) panic("failed to stat file");
+        linux_close(fd);
+
+        FileDefinition* new_definition = ARENA_ALLOC(FileDefinition, 1);
+        new_definition->full_path = full_path;
+        new_definition->size = stat.st_size;
+        new_definition->is_mapped = true;
+        map_content(new_definition);
+
+        vector_push(&g_file_definitions, new_definition);
+        return new_definition;
+    }
+
     else {
         s32 fd = linux_open(full_path, LINUX_FILE_FLAG_READONLY, 0);
         if (fd < 0) panic("failed to open file");
@@ -58,22 +133,72 @@ static FileDefinition* get_definition(char* full_path) {
     }
 }
 
-ByteVector* read(char* full_path, PPToken* inclusion_trigger) {
+FileInclusion* read(char* full_path, PPToken* inclusion_trigger) {
     FileDefinition* definition = get_definition(full_path);
 
     FileInclusion* inclusion = ARENA_ALLOC(FileInclusion, 1);
     inclusion->definition = definition;
     inclusion->inclusion_trigger = inclusion_trigger;
 
-    ByteVector* bytes = ARENA_ALLOC(ByteVector, 1);
-    for (size_t i = 0; i < definition->size; ++i) {
+    return inclusion;
+}
+
+FileInclusion* read_memory(char* name, char* content) {
+    FileDefinition* definition = ARENA_ALLOC(FileDefinition, 1);
+    definition->full_path = name;
+    definition->content = (u8*)content;
+    definition->size = strlen(content);
+
+    FileInclusion* inclusion = ARENA_ALLOC(FileInclusion, 1);
+    inclusion->definition = definition;
+    inclusion->inclusion_trigger = nullptr;
+
+    return inclusion;
+}
+
+/*
+Smart bytes for the range [start, end) of an included file. The
+bytes live on, the vector holding them is allocated in scratch.
+*/
+ByteVector* read_bytes(FileInclusion* inclusion, size_t start, size_t end, Arena* scratch) {
+    FileDefinition* definition = inclusion->definition;
+
+    ByteVector* bytes = ARENA_ALLOC_IN(scratch, ByteVector, 1);
+    vector_reserve_in(scratch, bytes, end - start);
+
+    for (size_t i = start; i < end && i < definition->size; ++i) {
         Byte* byte = ARENA_ALLOC(Byte, 1);
         byte->value = definition->content[i];
-        byte->origin = inclusion;
+        byte->origin = file_inclusion_handle(inclusion);
         byte->offset = i;
 
-        vector_push(bytes, byte);
+        vector_push_in(scratch, bytes, byte);
     }
 
     return bytes;
 }
+
+void reader_enable_low_memory(void) {
+    g_low_memory = true;
+}
+
+u8* file_content(FileDefinition* definition) {
+    if (definition->content == nullptr) {
+        map_content(definition);
+    }
+
+    return definition->content;
+}
+
+void file_acquire(FileDefinition* definition) {
+    definition->readers++;
+    file_content(definition);
+}
+
+void file_release(FileDefinition* definition) {
+    definition->readers--;
+
+    if (definition->is_mapped && definition->readers == 0) {
+        unmap_content(definition);
+    }
+}
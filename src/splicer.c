@@ -3,7 +3,7 @@
 #include <splicer.h>
 #include <vector.h>
 
-SplicedCharVector* splice(SourceCharVector* source_chars) {
+SplicedCharVector* splice(SourceCharVector* source_chars, Arena* scratch) {
     // check newline at end of file
     if (source_chars->count >= 1 &&
         source_chars->data[source_chars->count - 1]->value != '\n') {
@@ -21,7 +21,8 @@ SplicedCharVector* splice(SourceCharVector* source_chars) {
                          "backslash before last newline");
     }
 
-    SplicedCharVector* spliced_chars = ARENA_ALLOC(SplicedCharVector, 1);
+    SplicedCharVector* spliced_chars = ARENA_ALLOC_IN(scratch, SplicedCharVector, 1);
+    vector_reserve_in(scratch, spliced_chars, source_chars->count);
 
     for (size_t i = 0; i < source_chars->count;) {
         /*
@@ -37,9 +38,9 @@ SplicedCharVector* splice(SourceCharVector* source_chars) {
 
         SplicedChar* spliced_char = ARENA_ALLOC(SplicedChar, 1);
         spliced_char->value = source_chars->data[i]->value;
-        spliced_char->source_char = source_chars->data[i];
+        spliced_char->source_char = source_char_handle(source_chars->data[i]);
 
-        vector_push(spliced_chars, spliced_char);
+        vector_push_in(scratch, spliced_chars, spliced_char);
 
         i += 1;
     }
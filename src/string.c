@@ -1,16 +1,285 @@
 #include <arena.h>
+#include <cpu.h>
 #include <string.h>
 
+/*
+The routines below go a whole vector register at a time. A compare
+yields a mask with one bit per byte, so the first match is the
+lowest set bit of the mask. Every routine with a loop long enough to
+gain from wider registers exists once per register width, and
+string_init picks the widest set the machine runs: SSE2, which
+every x86-64 processor has, AVX2 or AVX-512.
+
+Loads past the end of a string may only touch the page the string
+ends in, so strlen reads aligned blocks, which never straddle a
+page, and streq reads a block only where it stays within the page.
+The mem routines know their length and never read beyond it.
+*/
+#define STRING_PAGE_SIZE 4096
+#define STRING_SSE2_ALL_MATCH 0xffff
+
+// the most bytes memchr_any can look for at once
+#define STRING_SET_MAX 8
+
+#define STRING_TARGET(name) __attribute__((target(name)))
+
+// bit i of the result is set iff byte i of a equals byte i of b
+#define STRING_MATCH_SSE2(Block, a, b) ((u64)(u32)__builtin_ia32_pmovmskb128((Block)((a) == (b))))
+#define STRING_MATCH_AVX2(Block, a, b) ((u64)(u32)__builtin_ia32_pmovmskb256((Block)((a) == (b))))
+#define STRING_MATCH_AVX512(Block, a, b) ((u64)__builtin_ia32_cmpb512_mask((a), (b), 0, ~0ULL))
+
+static u64 lowest_bit(u64 mask) {
+    return (u64)__builtin_ctzll(mask);
+}
+
+static u64 highest_bit(u64 mask) {
+    return 63 - (u64)__builtin_clzll(mask);
+}
+
+// true if a 16-byte read at pointer stays within its page
+static bool block_fits_page(void* pointer) {
+    return ((u64)pointer & (STRING_PAGE_SIZE - 1)) <= STRING_PAGE_SIZE - 16;
+}
+
+// below a single block, and for what is left after the last one
+static void memcpy_scalar(void* dest, void* src, size_t num_bytes) {
+    u8* d = (u8*)dest;
+    u8* s = (u8*)src;
+    for (size_t i = 0; i < num_bytes; ++i) {
+        d[i] = s[i];
+    }
+}
+
+static void* memset_scalar(void* ptr, int value, size_t num) {
+    u8* dest = (u8*)ptr;
+    u8 data = (u8)(value & 0xff);
+
+    for (size_t i = 0; i < num; ++i) {
+        dest[i] = data;
+    }
+    return ptr;
+}
+
+static void* memchr_scalar(void* ptr, int value, size_t num) {
+    u8* bytes = (u8*)ptr;
+    u8 byte = (u8)(value & 0xff);
+
+    for (size_t i = 0; i < num; ++i) {
+        if (bytes[i] == byte) return bytes + i;
+    }
+    return nullptr;
+}
+
+static void* memchr_any_scalar(void* ptr, char* set, size_t num) {
+    u8* bytes = (u8*)ptr;
+
+    for (size_t i = 0; i < num; ++i) {
+        for (char* c = set; *c != '\0'; ++c) {
+            if (bytes[i] == (u8)*c) return bytes + i;
+        }
+    }
+    return nullptr;
+}
+
+/*
+Defines the kernels for one register width. Inputs shorter than a
+block are handed to the kernels of the next narrower width, down to
+the scalar loops above.
+*/
+#define STRING_DEFINE_KERNELS(suffix, size, target, match, narrower)                                \
+    typedef char Block_##suffix __attribute__((vector_size(size)));                                 \
+    typedef char UnalignedBlock_##suffix __attribute__((vector_size(size), aligned(1)));            \
+                                                                                                    \
+    STRING_TARGET(target) static Block_##suffix block_load_##suffix(void* pointer) {                \
+        return *(UnalignedBlock_##suffix*)pointer;                                                  \
+    }                                                                                               \
+                                                                                                    \
+    STRING_TARGET(target) static void block_store_##suffix(void* pointer, Block_##suffix block) {   \
+        *(UnalignedBlock_##suffix*)pointer = block;                                                 \
+    }                                                                                               \
+                                                                                                    \
+    STRING_TARGET(target) static Block_##suffix block_splat_##suffix(u8 byte) {                     \
+        return (Block_##suffix){0} + (char)byte;                                                    \
+    }                                                                                               \
+                                                                                                    \
+    STRING_TARGET(target) static u64 block_match_##suffix(Block_##suffix a, Block_##suffix b) {     \
+        return match(Block_##suffix, a, b);                                                         \
+    }                                                                                               \
+                                                                                                    \
+    STRING_TARGET(target) static size_t strlen_##suffix(char* cstr) {                               \
+        char* block = (char*)((u64)cstr & ~(u64)((size) - 1));                                      \
+                                                                                                    \
+        /* the bytes in front of the string share its first block and are masked off */             \
+        u64 mask = block_match_##suffix(*(Block_##suffix*)block, (Block_##suffix){0}) >>            \
+                   (cstr - block);                                                                  \
+        if (mask != 0) {                                                                            \
+            return lowest_bit(mask);                                                                \
+        }                                                                                           \
+                                                                                                    \
+        while (true) {                                                                              \
+            block += (size);                                                                        \
+            mask = block_match_##suffix(*(Block_##suffix*)block, (Block_##suffix){0});             \
+                                                                                                    \
+            if (mask != 0) {                                                                        \
+                return (size_t)(block - cstr) + lowest_bit(mask);                                   \
+            }                                                                                       \
+        }                                                                                           \
+    }                                                                                               \
+                                                                                                    \
+    STRING_TARGET(target) static void memcpy_##suffix(void* dest, void* src, size_t num_bytes) {    \
+        u8* d = (u8*)dest;                                                                          \
+        u8* s = (u8*)src;                                                                           \
+                                                                                                    \
+        if (num_bytes < (size)) {                                                                   \
+            memcpy_##narrower(dest, src, num_bytes);                                                \
+            return;                                                                                 \
+        }                                                                                           \
+                                                                                                    \
+        for (size_t i = 0; i + (size) <= num_bytes; i += (size)) {                                  \
+            block_store_##suffix(d + i, block_load_##suffix(s + i));                                \
+        }                                                                                           \
+                                                                                                    \
+        /* the last block overlaps the previous one rather than going byte by byte */              \
+        size_t last = num_bytes - (size);                                                           \
+        block_store_##suffix(d + last, block_load_##suffix(s + last));                              \
+    }                                                                                               \
+                                                                                                    \
+    STRING_TARGET(target) static void* memset_##suffix(void* ptr, int value, size_t num) {          \
+        u8* dest = (u8*)ptr;                                                                        \
+                                                                                                    \
+        if (num < (size)) {                                                                         \
+            return memset_##narrower(ptr, value, num);                                              \
+        }                                                                                           \
+                                                                                                    \
+        Block_##suffix block = block_splat_##suffix((u8)(value & 0xff));                            \
+        for (size_t i = 0; i + (size) <= num; i += (size)) {                                        \
+            block_store_##suffix(dest + i, block);                                                  \
+        }                                                                                           \
+        block_store_##suffix(dest + num - (size), block);                                           \
+                                                                                                    \
+        return ptr;                                                                                 \
+    }                                                                                               \
+                                                                                                    \
+    STRING_TARGET(target) static void* memchr_##suffix(void* ptr, int value, size_t num) {          \
+        u8* bytes = (u8*)ptr;                                                                       \
+        Block_##suffix needle = block_splat_##suffix((u8)(value & 0xff));                           \
+                                                                                                    \
+        size_t i = 0;                                                                               \
+        for (; i + (size) <= num; i += (size)) {                                                    \
+            u64 mask = block_match_##suffix(block_load_##suffix(bytes + i), needle);                \
+                                                                                                    \
+            if (mask != 0) {                                                                        \
+                return bytes + i + lowest_bit(mask);                                                \
+            }                                                                                       \
+        }                                                                                           \
+                                                                                                    \
+        return memchr_##narrower(bytes + i, value, num - i);                                        \
+    }                                                                                               \
+                                                                                                    \
+    STRING_TARGET(target) static void* memchr_any_##suffix(void* ptr, char* set, size_t num) {      \
+        u8* bytes = (u8*)ptr;                                                                       \
+                                                                                                    \
+        Block_##suffix needles[STRING_SET_MAX];                                                     \
+        size_t set_size = 0;                                                                        \
+        for (; set[set_size] != '\0'; ++set_size) {                                                 \
+            needles[set_size] = block_splat_##suffix((u8)set[set_size]);                            \
+        }                                                                                           \
+                                                                                                    \
+        size_t i = 0;                                                                               \
+        for (; i + (size) <= num; i += (size)) {                                                    \
+            Block_##suffix block = block_load_##suffix(bytes + i);                                  \
+                                                                                                    \
+            u64 mask = 0;                                                                           \
+            for (size_t j = 0; j < set_size; ++j) {                                                 \
+                mask |= block_match_##suffix(block, needles[j]);                                    \
+            }                                                                                       \
+                                                                                                    \
+            if (mask != 0) {                                                                        \
+                return bytes + i + lowest_bit(mask);                                                \
+            }                                                                                       \
+        }                                                                                           \
+                                                                                                    \
+        return memchr_any_##narrower(bytes + i, set, num - i);                                      \
+    }
+
+STRING_DEFINE_KERNELS(sse2, 16, "sse2", STRING_MATCH_SSE2, scalar)
+STRING_DEFINE_KERNELS(avx2, 32, "avx2", STRING_MATCH_AVX2, sse2)
+STRING_DEFINE_KERNELS(avx512, 64, "avx512bw", STRING_MATCH_AVX512, avx2)
+
+typedef struct StringKernels {
+    char* name;
+    size_t (*strlen)(char* cstr);
+    void (*memcpy)(void* dest, void* src, size_t num_bytes);
+    void* (*memset)(void* ptr, int value, size_t num);
+    void* (*memchr)(void* ptr, int value, size_t num);
+    void* (*memchr_any)(void* ptr, char* set, size_t num);
+} StringKernels;
+
+#define STRING_KERNELS(suffix)             \
+    {                                      \
+        .name = #suffix,                   \
+        .strlen = strlen_##suffix,         \
+        .memcpy = memcpy_##suffix,         \
+        .memset = memset_##suffix,         \
+        .memchr = memchr_##suffix,         \
+        .memchr_any = memchr_any_##suffix, \
+    }
+
+static StringKernels g_sse2_kernels = STRING_KERNELS(sse2);
+static StringKernels g_avx2_kernels = STRING_KERNELS(avx2);
+static StringKernels g_avx512_kernels = STRING_KERNELS(avx512);
+
+// SSE2 until string_init knows better, so that nothing can run before a kernel is picked
+static StringKernels* g_string_kernels = &g_sse2_kernels;
+
+void string_init(void) {
+    if (g_cpu_features & CPU_FEATURE_AVX512BW) {
+        g_string_kernels = &g_avx512_kernels;
+    }
+
+    else if (g_cpu_features & CPU_FEATURE_AVX2) {
+        g_string_kernels = &g_avx2_kernels;
+    }
+
+    else {
+        g_string_kernels = &g_sse2_kernels;
+    }
+}
+
+char* string_kernels_name(void) {
+    return g_string_kernels->name;
+}
+
 size_t strlen(char* cstr) {
-    size_t len = 0;
-    while (cstr[len]) len++;
-    return len;
+    return g_string_kernels->strlen(cstr);
 }
 
 bool streq(char* a, char* b) {
-    for (; *a == *b; a++, b++)
+    // most names compared against each other already differ in the first byte
+    if (*a != *b) return false;
+
+    while (true) {
+        if (block_fits_page(a) && block_fits_page(b)) {
+            Block_sse2 block_a = block_load_sse2(a);
+            u64 equal = block_match_sse2(block_a, block_load_sse2(b));
+            u64 nul = block_match_sse2(block_a, (Block_sse2){0});
+
+            if (equal == STRING_SSE2_ALL_MATCH && nul == 0) {
+                a += 16;
+                b += 16;
+                continue;
+            }
+
+            // the first difference or terminator decides
+            u64 i = lowest_bit((~equal & STRING_SSE2_ALL_MATCH) | nul);
+            return a[i] == b[i];
+        }
+
+        if (*a != *b) return false;
         if (!*a) return true;
-    return false;
+        a++;
+        b++;
+    }
 }
 
 char* strcat(char* cstr1, char* cstr2) {
@@ -18,23 +287,14 @@ char* strcat(char* cstr1, char* cstr2) {
     size_t len2 = strlen(cstr2);
 
     char* buf = ARENA_ALLOC(char, len1 + len2 + 1);
-
-    for (size_t i = 0; i < len1; i++) {
-        buf[i] = cstr1[i];
-    }
-
-    for (size_t i = 0; i < len2; ++i) {
-        buf[i + len1] = cstr2[i];
-    }
+    memcpy(buf, cstr1, len1);
+    memcpy(buf + len1, cstr2, len2);
 
     return buf;
 }
 
 char* strrchr(char* cstr, char c) {
-    for (s64 i = strlen(cstr) - 1; i >= 0; --i) {
-        if (cstr[i] == c) return cstr + i;
-    }
-    return nullptr;
+    return memrchr(cstr, c, strlen(cstr));
 }
 
 char* strdup(char* cstr) {
@@ -46,19 +306,40 @@ char* strdup(char* cstr) {
 }
 
 void memcpy(void* dest, void* src, size_t num_bytes) {
-    u8* d = (u8*)dest;
-    u8* s = (u8*)src;
-    for (size_t i = 0; i < num_bytes; ++i) {
-        d[i] = s[i];
-    }
+    g_string_kernels->memcpy(dest, src, num_bytes);
 }
 
 void* memset(void* ptr, int value, size_t num) {
-    u8* dest = (u8*)ptr;
-    u8 data = (u8)(value & 0xff);
+    return g_string_kernels->memset(ptr, value, num);
+}
 
-    for (size_t i = 0; i < num; ++i) {
-        dest[i] = data;
+void* memchr(void* ptr, int value, size_t num) {
+    return g_string_kernels->memchr(ptr, value, num);
+}
+
+void* memchr_any(void* ptr, char* set, size_t num) {
+    return g_string_kernels->memchr_any(ptr, set, num);
+}
+
+// scanned backwards far less often than forwards, so it keeps to SSE2
+void* memrchr(void* ptr, int value, size_t num) {
+    u8* bytes = (u8*)ptr;
+    u8 byte = (u8)(value & 0xff);
+    Block_sse2 needle = block_splat_sse2(byte);
+
+    size_t end = num;
+    for (; end >= 16; end -= 16) {
+        u64 mask = block_match_sse2(block_load_sse2(bytes + end - 16), needle);
+
+        if (mask != 0) {
+            return bytes + end - 16 + highest_bit(mask);
+        }
     }
-    return ptr;
+
+    while (end > 0) {
+        end--;
+        if (bytes[end] == byte) return bytes + end;
+    }
+
+    return nullptr;
 }
@@ -13,18 +13,20 @@ typedef struct SplicedCharStream {
 /*
 Peeks ahead by offset number of spliced chars without crashing.
 If request goes out of bounds, returns a valid pointer to
-a dummy Spliced Char which lives in static memory.
+a dummy Spliced Char which lives in the arena, so that it
+can end up in the origin of a token like any other.
 */
 static SplicedChar* stream_peekahead(SplicedCharStream* stream, size_t offset) {
-    static SplicedChar EOF_SENTINEL = {
-        .value = 0,
-        .source_char = nullptr,
-    };
+    static SplicedChar* eof_sentinel = nullptr;
 
     size_t target_index = stream->current_index + offset;
 
     if (target_index >= stream->spliced_chars->count) {
-        return &EOF_SENTINEL;
+        if (eof_sentinel == nullptr) {
+            eof_sentinel = ARENA_ALLOC(SplicedChar, 1);
+        }
+
+        return eof_sentinel;
     }
 
     return stream->spliced_chars->data[target_index];
@@ -166,11 +168,20 @@ UTF8 UTF32_to_UTF8(u32 codepoint) {
 Encodes a vector of spliced chars (UTF-32) into
 a single C-standard null terminated UTF-8 string
 */
-static char* encode_UTF8(SplicedCharVector* spliced_chars, bool should_encode_UCN) {
-    // aggresive buffer (each UTF-32 becoming 4 bytes)
-    char* buf = ARENA_ALLOC(char, 4 * spliced_chars->count + 1);
+static char* encode_UTF8(SmallSplicedCharVector* spliced_chars, bool should_encode_UCN) {
+    static SplicedCharVector chars = {0};
+
+    chars.count = 0;
+    for (size_t i = 0; i < spliced_chars->count; ++i) {
+        vector_push(&chars, spliced_char_resolve(spliced_chars->data[i]));
+    }
+
+    // aggresive buffer (each UTF-32 becoming 4 bytes), trimmed at the end
+    size_t buf_size = 4 * spliced_chars->count + 1;
+    char* buf = ARENA_ALLOC(char, buf_size);
+
     SplicedCharStream stream = {
-        .spliced_chars = spliced_chars,
+        .spliced_chars = &chars,
         .current_index = 0,
     };
 
@@ -208,11 +219,23 @@ static char* encode_UTF8(SplicedCharVector* spliced_chars, bool should_encode_UC
     }
 
     buf[buf_index] = 0;
+    arena_try_extend(buf, buf_size, buf_index + 1);
     return buf;
 }
 
-static PPToken* pptoken_create(PPTokenKind kind, SplicedCharVector* origin) {
+static void origin_push(SmallSplicedCharVector* origin, SplicedChar* spliced_char) {
+    vector_push(origin, spliced_char_handle(spliced_char));
+}
+
+// a token whose characters are pushed onto its origin before pptoken_finish
+static PPToken* pptoken_alloc(void) {
     PPToken* pptoken = ARENA_ALLOC(PPToken, 1);
+    small_vector_init(&pptoken->origin);
+
+    return pptoken;
+}
+
+static PPToken* pptoken_finish(PPToken* pptoken, PPTokenKind kind) {
     pptoken->kind = kind;
 
     bool should_encode_UCN = false;
@@ -220,9 +243,8 @@ static PPToken* pptoken_create(PPTokenKind kind, SplicedCharVector* origin) {
         should_encode_UCN = true;
     }
 
-    pptoken->spelling = encode_UTF8(origin, should_encode_UCN);
+    pptoken->spelling = encode_UTF8(&pptoken->origin, should_encode_UCN);
     pptoken->length = strlen(pptoken->spelling);
-    pptoken->origin = origin;
 
     return pptoken;
 }
@@ -230,9 +252,10 @@ static PPToken* pptoken_create(PPTokenKind kind, SplicedCharVector* origin) {
 static bool check_hash_include(PPTokenVector* pptokens) {
     s64 i = pptokens->count - 1;
 
-    // 1. Skip WS backwards to find "include"
+    // 1. Skip WS backwards to find "include" or "embed"
     while (i >= 0 && pptokens->data[i]->kind == PP_WHITESPACE) i--;
-    if (i >= 0 && !pptoken_is(pptokens->data[i], PP_IDENTIFIER, "include")) return false;
+    if (i >= 0 && !pptoken_is(pptokens->data[i], PP_IDENTIFIER, "include") &&
+        !pptoken_is(pptokens->data[i], PP_IDENTIFIER, "embed")) return false;
 
     // 2. Skip WS backwards to find "#"
     i--;
@@ -251,7 +274,8 @@ static bool check_hash_include(PPTokenVector* pptokens) {
 }
 
 static PPToken* tokenize_header_name(SplicedCharStream* stream) {
-    SplicedCharVector* origin = ARENA_ALLOC(SplicedCharVector, 1);
+    PPToken* pptoken = pptoken_alloc();
+    SmallSplicedCharVector* origin = &pptoken->origin;
 
     u32 left_delim = stream_peekahead(stream, 0)->value;
     u32 right_delim = left_delim == '<' ? '>' : '\"';
@@ -267,7 +291,7 @@ static PPToken* tokenize_header_name(SplicedCharStream* stream) {
         if (spliced_char->value == left_delim ||
             spliced_char->value == right_delim) {
             delim_count++;
-            vector_push(origin, spliced_char);
+            origin_push(origin, spliced_char);
             stream_consume(stream, 1);
             continue;
         }
@@ -281,31 +305,32 @@ static PPToken* tokenize_header_name(SplicedCharStream* stream) {
         }
 
         else {
-            vector_push(origin, spliced_char);
+            origin_push(origin, spliced_char);
             stream_consume(stream, 1);
             continue;
         }
     }
 
-    return pptoken_create(PP_HEADERNAME, origin);
+    return pptoken_finish(pptoken, PP_HEADERNAME);
 }
 
 static PPToken* tokenize_string_literal(SplicedCharStream* stream) {
-    SplicedCharVector* origin = ARENA_ALLOC(SplicedCharVector, 1);
+    PPToken* pptoken = pptoken_alloc();
+    SmallSplicedCharVector* origin = &pptoken->origin;
 
     for (size_t quote_count = 0; quote_count < 2;) {
         SplicedChar* spliced_char = stream_peekahead(stream, 0);
 
         if (spliced_char->value == '\"') {
             quote_count++;
-            vector_push(origin, spliced_char);
+            origin_push(origin, spliced_char);
             stream_consume(stream, 1);
         }
 
         else if (spliced_char->value == '\\') {
-            vector_push(origin, spliced_char);
+            origin_push(origin, spliced_char);
             stream_consume(stream, 1);
-            vector_push(origin, stream_peekahead(stream, 0));
+            origin_push(origin, stream_peekahead(stream, 0));
             stream_consume(stream, 1);
             continue;
         }
@@ -319,30 +344,31 @@ static PPToken* tokenize_string_literal(SplicedCharStream* stream) {
         }
 
         else {
-            vector_push(origin, spliced_char);
+            origin_push(origin, spliced_char);
             stream_consume(stream, 1);
         }
     }
 
-    return pptoken_create(PP_STRING, origin);
+    return pptoken_finish(pptoken, PP_STRING);
 }
 
 static PPToken* tokenize_character_constant(SplicedCharStream* stream) {
-    SplicedCharVector* origin = ARENA_ALLOC(SplicedCharVector, 1);
+    PPToken* pptoken = pptoken_alloc();
+    SmallSplicedCharVector* origin = &pptoken->origin;
 
     for (size_t quote_count = 0; quote_count < 2;) {
         SplicedChar* spliced_char = stream_peekahead(stream, 0);
 
         if (spliced_char->value == '\'') {
             quote_count++;
-            vector_push(origin, spliced_char);
+            origin_push(origin, spliced_char);
             stream_consume(stream, 1);
         }
 
         else if (spliced_char->value == '\\') {
-            vector_push(origin, spliced_char);
+            origin_push(origin, spliced_char);
             stream_consume(stream, 1);
-            vector_push(origin, stream_peekahead(stream, 0));
+            origin_push(origin, stream_peekahead(stream, 0));
             stream_consume(stream, 1);
             continue;
         }
@@ -356,24 +382,25 @@ static PPToken* tokenize_character_constant(SplicedCharStream* stream) {
         }
 
         else {
-            vector_push(origin, spliced_char);
+            origin_push(origin, spliced_char);
             stream_consume(stream, 1);
         }
     }
 
-    return pptoken_create(PP_CHAR, origin);
+    return pptoken_finish(pptoken, PP_CHAR);
 }
 
 static PPToken* tokenize_block_comment(SplicedCharStream* stream) {
-    SplicedCharVector* origin = ARENA_ALLOC(SplicedCharVector, 1);
+    PPToken* pptoken = pptoken_alloc();
+    SmallSplicedCharVector* origin = &pptoken->origin;
 
     while (true) {
         SplicedChar* a = stream_peekahead(stream, 0);
         SplicedChar* b = stream_peekahead(stream, 1);
 
         if (a->value == '*' && b->value == '/') {
-            vector_push(origin, a);
-            vector_push(origin, b);
+            origin_push(origin, a);
+            origin_push(origin, b);
             stream_consume(stream, 2);
             break;
         }
@@ -383,17 +410,19 @@ static PPToken* tokenize_block_comment(SplicedCharStream* stream) {
         }
 
         else {
-            vector_push(origin, a);
+            origin_push(origin, a);
             stream_consume(stream, 1);
             continue;
         }
     }
 
-    return pptoken_create(PP_WHITESPACE, origin);
+    pptoken->is_comment = true;
+    return pptoken_finish(pptoken, PP_WHITESPACE);
 }
 
 static PPToken* tokenize_single_line_comment(SplicedCharStream* stream) {
-    SplicedCharVector* origin = ARENA_ALLOC(SplicedCharVector, 1);
+    PPToken* pptoken = pptoken_alloc();
+    SmallSplicedCharVector* origin = &pptoken->origin;
 
     while (true) {
         SplicedChar* spliced_char = stream_peekahead(stream, 0);
@@ -407,27 +436,30 @@ static PPToken* tokenize_single_line_comment(SplicedCharStream* stream) {
         }
 
         else {
-            vector_push(origin, spliced_char);
+            origin_push(origin, spliced_char);
             stream_consume(stream, 1);
             continue;
         }
     }
 
-    return pptoken_create(PP_WHITESPACE, origin);
+    pptoken->is_comment = true;
+    return pptoken_finish(pptoken, PP_WHITESPACE);
 }
 
 static PPToken* tokenize_newline(SplicedCharStream* stream) {
-    SplicedCharVector* origin = ARENA_ALLOC(SplicedCharVector, 1);
+    PPToken* pptoken = pptoken_alloc();
+    SmallSplicedCharVector* origin = &pptoken->origin;
     SplicedChar* spliced_char = stream_peekahead(stream, 0);
 
-    vector_push(origin, spliced_char);
+    origin_push(origin, spliced_char);
     stream_consume(stream, 1);
 
-    return pptoken_create(PP_NEWLINE, origin);
+    return pptoken_finish(pptoken, PP_NEWLINE);
 }
 
 static PPToken* tokenize_whitespace(SplicedCharStream* stream) {
-    SplicedCharVector* origin = ARENA_ALLOC(SplicedCharVector, 1);
+    PPToken* pptoken = pptoken_alloc();
+    SmallSplicedCharVector* origin = &pptoken->origin;
 
     while (true) {
         SplicedChar* spliced_char = stream_peekahead(stream, 0);
@@ -437,31 +469,32 @@ static PPToken* tokenize_whitespace(SplicedCharStream* stream) {
         }
 
         else {
-            vector_push(origin, spliced_char);
+            origin_push(origin, spliced_char);
             stream_consume(stream, 1);
             continue;
         }
     }
 
-    return pptoken_create(PP_WHITESPACE, origin);
+    return pptoken_finish(pptoken, PP_WHITESPACE);
 }
 
 static PPToken* tokenize_identifier(SplicedCharStream* stream) {
-    SplicedCharVector* origin = ARENA_ALLOC(SplicedCharVector, 1);
+    PPToken* pptoken = pptoken_alloc();
+    SmallSplicedCharVector* origin = &pptoken->origin;
 
     while (true) {
         SplicedChar* sc0 = stream_peekahead(stream, 0);
         u32 cp0 = sc0->value;
 
         if (is_digit(cp0) || is_nondigit(cp0) || is_XID_Continue(cp0)) {
-            vector_push(origin, sc0);
+            origin_push(origin, sc0);
             stream_consume(stream, 1);
             continue;
         }
 
         else if (cp0 == '\\' && is_XID_Continue(peek_UCN(stream))) {
             // consume the backslash and move on
-            vector_push(origin, sc0);
+            origin_push(origin, sc0);
             stream_consume(stream, 1);
             continue;
         }
@@ -471,14 +504,15 @@ static PPToken* tokenize_identifier(SplicedCharStream* stream) {
         }
     }
 
-    return pptoken_create(PP_IDENTIFIER, origin);
+    return pptoken_finish(pptoken, PP_IDENTIFIER);
 }
 
 static PPToken* tokenize_pp_number(SplicedCharStream* stream) {
-    SplicedCharVector* origin = ARENA_ALLOC(SplicedCharVector, 1);
+    PPToken* pptoken = pptoken_alloc();
+    SmallSplicedCharVector* origin = &pptoken->origin;
 
     SplicedChar* sc_start = stream_peekahead(stream, 0);
-    vector_push(origin, sc_start);
+    origin_push(origin, sc_start);
     stream_consume(stream, 1);
 
     while (true) {
@@ -489,21 +523,21 @@ static PPToken* tokenize_pp_number(SplicedCharStream* stream) {
 
         if ((cp0 == 'e' || cp0 == 'E' || cp0 == 'p' || cp0 == 'P') &&
             (cp1 == '+' || cp1 == '-')) {
-            vector_push(origin, sc0);
-            vector_push(origin, sc1);
+            origin_push(origin, sc0);
+            origin_push(origin, sc1);
             stream_consume(stream, 2);
             continue;
         }
 
         else if (cp0 == '.') {
-            vector_push(origin, sc0);
+            origin_push(origin, sc0);
             stream_consume(stream, 1);
             continue;
         }
 
         else if (cp0 == '\'') {
             if (is_digit(cp1) || is_nondigit(cp1) || is_XID_Continue(cp1)) {
-                vector_push(origin, sc0);
+                origin_push(origin, sc0);
                 stream_consume(stream, 1);
                 continue;
             } else {
@@ -514,7 +548,7 @@ static PPToken* tokenize_pp_number(SplicedCharStream* stream) {
 
         // D. Digits & Identifiers (covers normal 'e' without sign too)
         else if (is_digit(cp0) || is_nondigit(cp0) || is_XID_Continue(cp0)) {
-            vector_push(origin, sc0);
+            origin_push(origin, sc0);
             stream_consume(stream, 1);
             continue;
         }
@@ -522,7 +556,7 @@ static PPToken* tokenize_pp_number(SplicedCharStream* stream) {
         // E. UCNs
         // Same logic: eat backslash if UCN is valid ID char, let loop handle the rest
         else if (cp0 == '\\' && is_XID_Continue(peek_UCN(stream))) {
-            vector_push(origin, sc0);
+            origin_push(origin, sc0);
             stream_consume(stream, 1);
             continue;
         }
@@ -532,11 +566,12 @@ static PPToken* tokenize_pp_number(SplicedCharStream* stream) {
         }
     }
 
-    return pptoken_create(PP_NUMBER, origin);
+    return pptoken_finish(pptoken, PP_NUMBER);
 }
 
 static PPToken* tokenize_punctuator(SplicedCharStream* stream) {
-    SplicedCharVector* origin = ARENA_ALLOC(SplicedCharVector, 1);
+    PPToken* pptoken = pptoken_alloc();
+    SmallSplicedCharVector* origin = &pptoken->origin;
 
     // Peek ahead to max possible punctuator length (4 for %:%:)
     SplicedChar* sc0 = stream_peekahead(stream, 0);
@@ -687,112 +722,188 @@ static PPToken* tokenize_punctuator(SplicedCharStream* stream) {
 
     // Common Construction Logic
     for (size_t i = 0; i < len; i++) {
-        vector_push(origin, stream_peekahead(stream, i));
+        origin_push(origin, stream_peekahead(stream, i));
     }
     stream_consume(stream, len);
 
-    return pptoken_create(kind, origin);
+    return pptoken_finish(pptoken, kind);
 }
 
-PPTokenVector* tokenize(SplicedCharVector* spliced_chars) {
-    SplicedCharStream stream = {
-        .spliced_chars = spliced_chars,
-        .current_index = 0,
-    };
+/*
+Lexes the one preprocessing token at the front of the stream.
+preceding holds the tokens before it on the line, which decide
+whether a header name may start here, nullptr if none can.
+*/
+static PPToken* tokenize_next(SplicedCharStream* stream, PPTokenVector* preceding) {
+    SplicedChar* sc0 = stream_peekahead(stream, 0);
+    SplicedChar* sc1 = stream_peekahead(stream, 1);
+    SplicedChar* sc2 = stream_peekahead(stream, 2);
 
-    PPTokenVector* pptokens = ARENA_ALLOC(PPTokenVector, 1);
-    while (true) {
-        SplicedChar* sc0 = stream_peekahead(&stream, 0);
-        SplicedChar* sc1 = stream_peekahead(&stream, 1);
-        SplicedChar* sc2 = stream_peekahead(&stream, 2);
+    u32 cp0 = sc0->value;
+    u32 cp1 = sc1->value;
+    u32 cp2 = sc2->value;
 
-        u32 cp0 = sc0->value;
-        u32 cp1 = sc1->value;
-        u32 cp2 = sc2->value;
+    // header names
+    if ((cp0 == '<' || cp0 == '\"') && preceding != nullptr && check_hash_include(preceding)) {
+        return tokenize_header_name(stream);
+    }
 
-        if (cp0 == 0) {
-            break;
-        }
+    // "string literals"
+    else if ((cp0 == 'u' && cp1 == '8' && cp2 == '\"') ||
+             (cp0 == 'u' && cp1 == '\"') ||
+             (cp0 == 'U' && cp1 == '\"') ||
+             (cp0 == 'L' && cp1 == '\"') ||
+             (cp0 == '\"')) {
+        return tokenize_string_literal(stream);
+    }
 
-        PPToken* pptoken = nullptr;
+    // 'character constants'
+    else if ((cp0 == 'u' && cp1 == '8' && cp2 == '\'') ||
+             (cp0 == 'u' && cp1 == '\'') ||
+             (cp0 == 'U' && cp1 == '\'') ||
+             (cp0 == 'L' && cp1 == '\'') ||
+             (cp0 == '\'')) {
+        return tokenize_character_constant(stream);
+    }
 
-        // header names
-        if ((cp0 == '<' || cp0 == '\"') && check_hash_include(pptokens)) {
-            pptoken = tokenize_header_name(&stream);
-        }
+    /* BLOCK COMMENTS */
+    else if (cp0 == '/' && cp1 == '*') {
+        return tokenize_block_comment(stream);
+    }
 
-        // "string literals"
-        else if ((cp0 == 'u' && cp1 == '8' && cp2 == '\"') ||
-                 (cp0 == 'u' && cp1 == '\"') ||
-                 (cp0 == 'U' && cp1 == '\"') ||
-                 (cp0 == 'L' && cp1 == '\"') ||
-                 (cp0 == '\"')) {
-            pptoken = tokenize_string_literal(&stream);
-        }
+    // single line comments
+    else if (cp0 == '/' && cp1 == '/') {
+        return tokenize_single_line_comment(stream);
+    }
 
-        // 'character constants'
-        else if ((cp0 == 'u' && cp1 == '8' && cp2 == '\'') ||
-                 (cp0 == 'u' && cp1 == '\'') ||
-                 (cp0 == 'U' && cp1 == '\'') ||
-                 (cp0 == 'L' && cp1 == '\'') ||
-                 (cp0 == '\'')) {
-            pptoken = tokenize_character_constant(&stream);
-        }
+    // newlines
+    else if (cp0 == '\n') {
+        return tokenize_newline(stream);
+    }
 
-        /* BLOCK COMMENTS */
-        else if (cp0 == '/' && cp1 == '*') {
-            pptoken = tokenize_block_comment(&stream);
-        }
+    // whitespace
+    else if (is_inline_whitespace(cp0)) {
+        return tokenize_whitespace(stream);
+    }
 
-        // single line comments
-        else if (cp0 == '/' && cp1 == '/') {
-            pptoken = tokenize_single_line_comment(&stream);
-        }
+    // identifiers
+    else if (cp0 == '\\' && (cp1 == 'u' || cp1 == 'U')) {
+        u32 codepoint = peek_UCN(stream);
 
-        // newlines
-        else if (cp0 == '\n') {
-            pptoken = tokenize_newline(&stream);
+        if (is_XID_Start(codepoint)) {
+            return tokenize_identifier(stream);
         }
 
-        // whitespace
-        else if (is_inline_whitespace(cp0)) {
-            pptoken = tokenize_whitespace(&stream);
+        else {
+            panic("invalid identifier found");
         }
+    }
 
-        // identifiers
-        else if (cp0 == '\\' && (cp1 == 'u' || cp1 == 'U')) {
-            u32 codepoint = peek_UCN(&stream);
-
-            if (is_XID_Start(codepoint)) {
-                pptoken = tokenize_identifier(&stream);
-            }
+    else if (is_nondigit(cp0) || is_XID_Start(cp0)) {
+        return tokenize_identifier(stream);
+    }
 
-            else {
-                panic("invalid identifier found");
-            }
-        }
+    // pp numbers
+    else if (is_digit(cp0) || (cp0 == '.' && is_digit(cp1))) {
+        return tokenize_pp_number(stream);
+    }
 
-        else if (is_nondigit(cp0) || is_XID_Start(cp0)) {
-            pptoken = tokenize_identifier(&stream);
-        }
+    // punctuators and others
+    else {
+        return tokenize_punctuator(stream);
+    }
+}
 
-        // pp numbers
-        else if (is_digit(cp0) || (cp0 == '.' && is_digit(cp1))) {
-            pptoken = tokenize_pp_number(&stream);
-        }
+// the tokens live on, the vector holding them is allocated in scratch
+PPTokenVector* tokenize(SplicedCharVector* spliced_chars, Arena* scratch) {
+    SplicedCharStream stream = {
+        .spliced_chars = spliced_chars,
+        .current_index = 0,
+    };
 
-        // punctuators and others
-        else {
-            pptoken = tokenize_punctuator(&stream);
-        }
+    PPTokenVector* pptokens = ARENA_ALLOC_IN(scratch, PPTokenVector, 1);
+    vector_reserve_in(scratch, pptokens, spliced_chars->count / TOKENIZER_BYTES_PER_TOKEN + 1);
 
-        vector_push(pptokens, pptoken);
+    while (stream_peekahead(&stream, 0)->value != 0) {
+        PPToken* pptoken = tokenize_next(&stream, pptokens);
+        vector_push_in(scratch, pptokens, pptoken);
     }
 
     return pptokens;
 }
 
+typedef struct SplicedCharBuffer {
+    SplicedChar* data;
+    size_t count;
+    size_t capacity;
+} SplicedCharBuffer;
+
+/*
+Lexes a spelling that did not come from a file, the result of
+a `##`. The characters live in scratch buffers reused by every
+call, only the token itself is allocated, and it is reported
+at location. Returns nullptr unless the whole spelling forms
+exactly one preprocessing token.
+*/
+PPToken* retokenize(char* spelling, SplicedChar* location) {
+    static SplicedCharBuffer chars = {0};
+    static SplicedCharVector char_pointers = {0};
+
+    chars.count = 0;
+    for (char* cursor = spelling; *cursor != '\0';) {
+        SplicedChar spliced_char = {
+            .value = decode_UTF8(&cursor),
+            .source_char = location->source_char,
+        };
+
+        vector_push(&chars, spliced_char);
+    }
+
+    // only now that chars no longer moves
+    char_pointers.count = 0;
+    for (size_t i = 0; i < chars.count; ++i) {
+        vector_push(&char_pointers, &chars.data[i]);
+    }
+
+    SplicedCharStream stream = {
+        .spliced_chars = &char_pointers,
+        .current_index = 0,
+    };
+
+    // comments are no tokens, and would run past the spelling
+    u32 cp0 = stream_peekahead(&stream, 0)->value;
+    u32 cp1 = stream_peekahead(&stream, 1)->value;
+    if (cp0 == 0 || (cp0 == '/' && (cp1 == '/' || cp1 == '*'))) {
+        return nullptr;
+    }
+
+    PPToken* pptoken = tokenize_next(&stream, nullptr);
+
+    if (stream.current_index != char_pointers.count || pptoken->kind == PP_WHITESPACE) {
+        return nullptr;
+    }
+
+    // The origin must outlive the scratch buffers,
+    // it is kept only for where to report the token.
+    small_vector_init(&pptoken->origin);
+    vector_push(&pptoken->origin, spliced_char_handle(location));
+
+    return pptoken;
+}
+
 bool pptoken_is(PPToken* pptoken, PPTokenKind kind, char* spelling) {
     if (pptoken->kind != kind) return false;
     return streq(pptoken->spelling, spelling);
 }
+
+Byte* pptoken_first_byte(PPToken* pptoken) {
+    SplicedChar* spliced_char = spliced_char_resolve(pptoken->origin.data[0]);
+    SourceChar* source_char = source_char_resolve(spliced_char->source_char);
+    return byte_resolve(source_char->origin.data[0]);
+}
+
+Byte* pptoken_last_byte(PPToken* pptoken) {
+    SplicedChar* spliced_char = spliced_char_resolve(pptoken->origin.data[pptoken->origin.count - 1]);
+    SourceChar* source_char = source_char_resolve(spliced_char->source_char);
+    return byte_resolve(source_char->origin.data[source_char->origin.count - 1]);
+}
@@ -1591,3 +1591,35 @@ bool is_hex_digit(u32 codepoint) {
            (codepoint >= 'a' && codepoint <= 'f') ||
            (codepoint >= 'A' && codepoint <= 'F');
 }
+
+/*
+Decodes the code point at *cursor and steps past it. Only for
+strings we encoded ourselves, which are always well-formed.
+*/
+u32 decode_UTF8(char** cursor) {
+    u8* p = (u8*)*cursor;
+    u32 codepoint = p[0];
+    size_t length = 1;
+
+    if ((p[0] & 0xe0) == 0xc0) {
+        codepoint = p[0] & 0x1f;
+        length = 2;
+    }
+
+    else if ((p[0] & 0xf0) == 0xe0) {
+        codepoint = p[0] & 0x0f;
+        length = 3;
+    }
+
+    else if ((p[0] & 0xf8) == 0xf0) {
+        codepoint = p[0] & 0x07;
+        length = 4;
+    }
+
+    for (size_t i = 1; i < length; ++i) {
+        codepoint = (codepoint << 6) | (p[i] & 0x3f);
+    }
+
+    *cursor += length;
+    return codepoint;
+}
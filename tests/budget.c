@@ -0,0 +1,8 @@
+#include "budget.h"
+#include "budget.h"
+
+#define JOIN(a, b) a ## b
+#define STR(x) #x
+
+int JOIN(value_, __LINE__) = SQUARE(__LINE__);
+char* name = STR(PAIR(1, 2));
@@ -0,0 +1,4 @@
+#define SQUARE(x) ((x) * (x))
+#define PAIR(a, b) {a, b}
+
+int table[] = PAIR(SQUARE(2), SQUARE(3));
@@ -0,0 +1,3 @@
+FOO
+G(2)
+H
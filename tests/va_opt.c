@@ -0,0 +1,21 @@
+#define EMP
+#define F(...) f(0 __VA_OPT__(,) __VA_ARGS__)
+
+F(EMP)
+F()
+F(1)
+F(EMP, 1)
+
+#define H4(X, ...) __VA_OPT__(a X ## X) ## b
+#define V(...) __VA_OPT__(a ) ## b
+#define W(...) a ## __VA_OPT__( b)
+#define H3(X, ...) #__VA_OPT__(X##X X##X)
+#define S(...) # __VA_OPT__(x  y)
+
+H4(, 1)
+V(1)
+V()
+W(1)
+W()
+H3(, 0)
+S(1) S()